@@ -0,0 +1,164 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wlpinyin.h"
+
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	_Alignas(ARENA_ALIGN) char data[];
+};
+
+// heap traffic of all arenas, must stay flat once the arenas are warm
+static atomic_uint_fast64_t arena_mallocs;
+static atomic_uint_fast64_t arena_frees;
+
+static struct arena_chunk *arena_chunk_new(size_t size) {
+	struct arena_chunk *chunk = malloc(sizeof(*chunk) + size);
+	if (chunk == NULL)
+		return NULL;
+	atomic_fetch_add(&arena_mallocs, 1);
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+static void arena_chunk_free(struct arena_chunk *chunk) {
+	atomic_fetch_add(&arena_frees, 1);
+	free(chunk);
+}
+
+void arena_init(struct arena *arena, size_t chunk_size) {
+	arena->head = NULL;
+	arena->chunk_size = chunk_size;
+	arena->last = NULL;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	struct arena_chunk *chunk = arena->head;
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		size_t chunk_size = arena->chunk_size;
+		chunk = arena_chunk_new(size > chunk_size ? size : chunk_size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->next = arena->head;
+		arena->head = chunk;
+	}
+
+	void *ptr = &chunk->data[chunk->used];
+	chunk->used += size;
+	arena->last = ptr;
+	return ptr;
+}
+
+char *arena_strdup(struct arena *arena, const char *str) {
+	return arena_strndup(arena, str, strlen(str));
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t len) {
+	char *dup = arena_alloc(arena, len + 1);
+	if (dup == NULL)
+		return NULL;
+	memcpy(dup, str, len);
+	dup[len] = '\0';
+	return dup;
+}
+
+char *arena_printf(struct arena *arena, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	if (len < 0)
+		return NULL;
+
+	char *str = arena_alloc(arena, len + 1);
+	if (str == NULL)
+		return NULL;
+
+	va_start(args, fmt);
+	vsnprintf(str, len + 1, fmt, args);
+	va_end(args);
+	return str;
+}
+
+char *arena_append(struct arena *arena, char *str, const char *fmt, ...) {
+	size_t prev = str ? strlen(str) : 0;
+
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	if (len < 0)
+		return str;
+
+	// Grow in place when str is the latest allocation and the chunk has room
+	struct arena_chunk *chunk = arena->head;
+	size_t need = prev + len + 1;
+	if (str == NULL || str != arena->last ||
+			(size_t)(&chunk->data[chunk->size] - str) < need) {
+		char *grown = arena_alloc(arena, need);
+		if (grown == NULL)
+			return str;
+		if (str)
+			memcpy(grown, str, prev);
+		str = grown;
+	} else {
+		size_t used = ((size_t)(str - chunk->data) + need + ARENA_ALIGN - 1) &
+									~(size_t)(ARENA_ALIGN - 1);
+		if (used > chunk->used)
+			chunk->used = used;
+	}
+
+	va_start(args, fmt);
+	vsnprintf(&str[prev], len + 1, fmt, args);
+	va_end(args);
+	return str;
+}
+
+void arena_reset(struct arena *arena) {
+	struct arena_chunk *chunk = arena->head;
+	arena->last = NULL;
+	if (chunk == NULL)
+		return;
+
+	if (chunk->next == NULL) {
+		chunk->used = 0;
+		return;
+	}
+
+	// Overflowed into several chunks, replace them with one big enough for the
+	// whole frame so the next one does not touch the heap
+	size_t total = 0;
+	while (chunk) {
+		struct arena_chunk *next = chunk->next;
+		total += chunk->size;
+		arena_chunk_free(chunk);
+		chunk = next;
+	}
+	arena->head = arena_chunk_new(total);
+}
+
+void arena_finish(struct arena *arena) {
+	struct arena_chunk *chunk = arena->head;
+	while (chunk) {
+		struct arena_chunk *next = chunk->next;
+		arena_chunk_free(chunk);
+		chunk = next;
+	}
+	arena->head = NULL;
+	arena->last = NULL;
+}
+
+void arena_counters(uint64_t *mallocs, uint64_t *frees) {
+	*mallocs = atomic_load(&arena_mallocs);
+	*frees = atomic_load(&arena_frees);
+}
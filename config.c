@@ -1,3 +1,4 @@
+#include "text-input-unstable-v3-client-protocol.h"
 #include "wlpinyin.h"
 
 static xkb_keysym_t records[2];
@@ -8,3 +9,19 @@ bool im_toggle(struct xkb_state *xkb, xkb_keysym_t keysym, bool pressed) {
 	return pressed == false && records[0] == XKB_KEY_Control_L &&
 				 records[1] == XKB_KEY_Control_L;
 }
+
+// Only secrets bypass rime and the panel, so nothing typed there reaches its
+// user dictionary. Everywhere else the user's own ascii toggle decides.
+static const enum im_mode purpose_modes[] = {
+		[ZWP_TEXT_INPUT_V3_CONTENT_PURPOSE_PASSWORD] = IM_MODE_PASSTHROUGH,
+		[ZWP_TEXT_INPUT_V3_CONTENT_PURPOSE_PIN] = IM_MODE_PASSTHROUGH,
+};
+
+enum im_mode im_content_mode(uint32_t hint, uint32_t purpose) {
+	if (hint & (ZWP_TEXT_INPUT_V3_CONTENT_HINT_HIDDEN_TEXT |
+							ZWP_TEXT_INPUT_V3_CONTENT_HINT_SENSITIVE_DATA))
+		return IM_MODE_PASSTHROUGH;
+	if (purpose >= sizeof(purpose_modes) / sizeof(purpose_modes[0]))
+		return IM_MODE_RIME;
+	return purpose_modes[purpose];
+}
@@ -0,0 +1,145 @@
+/*
+ * Microbenchmark of the popup background fills: the cairo calls the renderer
+ * used before, against the popup_fill.c kernels, on the same panel and cells.
+ * Build with -Dpopup=enabled, then: ninja -C build fill_bench
+ */
+#ifdef ENABLE_POPUP
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "wlpinyin.h"
+
+#define PANEL_WIDTH 640
+#define PANEL_HEIGHT 40
+#define CELLS 10
+#define CORNER_RADIUS 4
+#define ITERATIONS 20000
+#define BACKGROUND_COLOR 0.25, 0.25, 0.27, 0.95
+#define HIGHLIGHT_COLOR 0.28, 0.39, 0.57, 0.98
+
+static uint64_t get_nanoseconds() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+/* The renderer's path before the kernels, kept here for comparison only */
+static void draw_rounded_rectangle(cairo_t *cr,
+																	 double x,
+																	 double y,
+																	 double width,
+																	 double height,
+																	 double radius) {
+	cairo_move_to(cr, x + radius, y);
+	cairo_line_to(cr, x + width - radius, y);
+	cairo_curve_to(cr, x + width, y, x + width, y, x + width, y + radius);
+	cairo_line_to(cr, x + width, y + height - radius);
+	cairo_curve_to(cr, x + width, y + height, x + width, y + height,
+								 x + width - radius, y + height);
+	cairo_line_to(cr, x + radius, y + height);
+	cairo_curve_to(cr, x, y + height, x, y + height, x, y + height - radius);
+	cairo_line_to(cr, x, y + radius);
+	cairo_curve_to(cr, x, y, x, y, x + radius, y);
+}
+
+static void cairo_panel(cairo_surface_t *surface) {
+	cairo_t *cr = cairo_create(surface);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_rgba(cr, BACKGROUND_COLOR);
+	draw_rounded_rectangle(cr, 0, 0, PANEL_WIDTH, PANEL_HEIGHT, CORNER_RADIUS);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+}
+
+static void cairo_cells(cairo_surface_t *surface) {
+	cairo_t *cr = cairo_create(surface);
+	int cell_width = PANEL_WIDTH / CELLS;
+	for (int col = 0; col < CELLS; col++) {
+		cairo_save(cr);
+		cairo_rectangle(cr, col * cell_width, 0, cell_width, PANEL_HEIGHT);
+		cairo_clip(cr);
+		cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+		cairo_paint(cr);
+		cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+		cairo_set_source_rgba(cr, BACKGROUND_COLOR);
+		draw_rounded_rectangle(cr, 0, 0, PANEL_WIDTH, PANEL_HEIGHT,
+													 CORNER_RADIUS);
+		cairo_fill(cr);
+		cairo_restore(cr);
+	}
+	cairo_destroy(cr);
+}
+
+static void cairo_highlight(cairo_surface_t *surface) {
+	cairo_t *cr = cairo_create(surface);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_rgba(cr, HIGHLIGHT_COLOR);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+}
+
+static void kernel_panel(void *data, int stride) {
+	fill_rect(data, stride, 0, 0, PANEL_WIDTH, PANEL_HEIGHT,
+						fill_pixel(BACKGROUND_COLOR));
+	fill_round_corners(data, stride, PANEL_WIDTH, PANEL_HEIGHT, CORNER_RADIUS,
+										 0, 0, PANEL_WIDTH, PANEL_HEIGHT);
+}
+
+static void kernel_cells(void *data, int stride) {
+	int cell_width = PANEL_WIDTH / CELLS;
+	uint32_t background = fill_pixel(BACKGROUND_COLOR);
+	for (int col = 0; col < CELLS; col++) {
+		fill_rect(data, stride, col * cell_width, 0, cell_width, PANEL_HEIGHT,
+							background);
+		fill_round_corners(data, stride, PANEL_WIDTH, PANEL_HEIGHT, CORNER_RADIUS,
+											 col * cell_width, 0, cell_width, PANEL_HEIGHT);
+	}
+}
+
+static void kernel_highlight(void *data, int stride) {
+	fill_rect(data, stride, 0, 0, PANEL_WIDTH / CELLS, PANEL_HEIGHT,
+						fill_pixel(HIGHLIGHT_COLOR));
+}
+
+static void bench(const char *name,
+									void (*cairo_fn)(cairo_surface_t *),
+									void (*kernel_fn)(void *, int),
+									int width) {
+	cairo_surface_t *surface =
+			cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, PANEL_HEIGHT);
+	unsigned char *data = cairo_image_surface_get_data(surface);
+	int stride = cairo_image_surface_get_stride(surface);
+
+	uint64_t start = get_nanoseconds();
+	for (int i = 0; i < ITERATIONS; i++)
+		cairo_fn(surface);
+	uint64_t cairo_ns = (get_nanoseconds() - start) / ITERATIONS;
+
+	start = get_nanoseconds();
+	for (int i = 0; i < ITERATIONS; i++)
+		kernel_fn(data, stride);
+	uint64_t kernel_ns = (get_nanoseconds() - start) / ITERATIONS;
+
+	printf("%-10s cairo %8llu ns  kernel %8llu ns  %.1fx\n", name,
+				 (unsigned long long)cairo_ns, (unsigned long long)kernel_ns,
+				 kernel_ns ? (double)cairo_ns / kernel_ns : 0.0);
+	cairo_surface_destroy(surface);
+}
+
+int main() {
+	printf("%dx%d panel, %d cells, %d iterations\n", PANEL_WIDTH, PANEL_HEIGHT,
+				 CELLS, ITERATIONS);
+	bench("panel", cairo_panel, kernel_panel, PANEL_WIDTH);
+	bench("cells", cairo_cells, kernel_cells, PANEL_WIDTH);
+	bench("highlight", cairo_highlight, kernel_highlight, PANEL_WIDTH / CELLS);
+	return EXIT_SUCCESS;
+}
+
+#else
+
+int main() {
+	return 0;
+}
+
+#endif /* ENABLE_POPUP */
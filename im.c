@@ -1,7 +1,11 @@
-#include <poll.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/signalfd.h>
@@ -11,10 +15,13 @@
 
 #include "wlpinyin.h"
 
+#define PREFETCH_DELAY_MS 150  // quiet time after a key before paging ahead
+
 struct wlpinyin_key {
 	xkb_keysym_t xkb_keysym;
 	uint32_t keycode;
 	bool pressed;
+	uint64_t event_us;
 };
 
 static int32_t get_miliseconds() {
@@ -23,57 +30,383 @@ static int32_t get_miliseconds() {
 	return time.tv_sec * 1000 + time.tv_nsec / (1000 * 1000);
 }
 
-static void im_send_text(struct wlpinyin_state *state, const char *text) {
-	wlpinyin_dbg("upd_text: %s", text ? text : "");
-	zwp_input_method_v2_commit_string(state->input_method, text ? text : "");
+static uint64_t get_microseconds() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+// Remember the preedit sent, the buffer only grows so typing does not allocate
+static void im_sent_preedit_store(struct wlpinyin_state *state,
+																	const char *text) {
+	size_t len = strlen(text) + 1;
+	if (len > state->sent_preedit_cap) {
+		size_t cap = state->sent_preedit_cap ? state->sent_preedit_cap : 64;
+		while (cap < len)
+			cap *= 2;
+		char *buf = realloc(state->sent_preedit, cap);
+		if (buf == NULL) {
+			// compare against nothing, every preedit is sent
+			free(state->sent_preedit);
+			state->sent_preedit = NULL;
+			state->sent_preedit_cap = 0;
+			return;
+		}
+		state->sent_preedit = buf;
+		state->sent_preedit_cap = cap;
+	}
+	memcpy(state->sent_preedit, text, len);
+}
+
+void im_set_preedit(struct wlpinyin_state *state,
+										const char *text,
+										int begin,
+										int end) {
+	if (state->sent_preedit != NULL && !strcmp(state->sent_preedit, text) &&
+			state->sent_begin == begin && state->sent_end == end) {
+		state->stats.suppressed_preedits++;
+		return;
+	}
+
+	zwp_input_method_v2_set_preedit_string(state->input_method, text, begin,
+																				 end);
+	im_sent_preedit_store(state, text);
+	state->sent_begin = begin;
+	state->sent_end = end;
+	state->sent_pending = true;
+	state->preedit_pending = true;
+}
+
+void im_commit_string(struct wlpinyin_state *state, const char *text) {
+	if (text == NULL || strlen(text) == 0)
+		return;
+	wlpinyin_dbg("upd_text: %s", text);
+	zwp_input_method_v2_commit_string(state->input_method, text);
+	state->sent_pending = true;
+}
+
+void im_commit(struct wlpinyin_state *state) {
+	if (!state->sent_pending) {
+		state->stats.suppressed_commits++;
+		return;
+	}
+
+	// A commit resets the preedit it does not carry, resend a suppressed one
+	if (!state->preedit_pending && state->sent_preedit != NULL &&
+			state->sent_preedit[0] != '\0')
+		zwp_input_method_v2_set_preedit_string(state->input_method,
+																					 state->sent_preedit,
+																					 state->sent_begin, state->sent_end);
+	zwp_input_method_v2_commit(state->input_method, state->im_serial);
+	state->sent_pending = false;
+	state->preedit_pending = false;
 }
 
 static void noop() {}
 
-static void im_handle_key(struct wlpinyin_state *state,
-													struct wlpinyin_key *keynode) {
-	if (state->xkb_state == NULL)
+// Send the text committed so far, so a forwarded key cannot overtake it
+static void im_batch_commit(struct wlpinyin_state *state) {
+	im_commit_string(state, state->batch_commit);
+	im_commit(state);
+	state->batch_commit = NULL;
+	arena_reset(&state->batch_arena);
+}
+
+// Apply what the batch queued so far, once the worker releases the engine
+static void im_batch_apply(struct wlpinyin_state *state) {
+	if (!key_queue_idle(state->keys))
 		return;
 
-	bool handled = false;
-	if (state->im_activated && state->im_enabled) {
-		if (im_toggle(state->xkb_state, keynode->xkb_keysym, keynode->pressed)) {
-			im_engine_toggle(state->engine);
-			handled = true;
-		}
+	bool update = state->batch_handled || state->panel_deferred;
+	if (state->batch_focus) {
+		state->batch_focus = false;
+		im_engine_reset(state->engine);
+		update = true;
+	}
+	if (!update)
+		return;
 
-		if (!handled && keynode->pressed) {
-			handled =
-					im_engine_key(state->engine, keynode->xkb_keysym,
-												xkb_state_serialize_mods(
-														state->xkb_state, XKB_STATE_MODS_EFFECTIVE |
-																									XKB_STATE_LAYOUT_EFFECTIVE));
-		}
+	state->panel_deferred = false;
+	im_panel_update(state);
+	im_batch_commit(state);
+	state->batch_handled = false;
+}
 
-		if (handled) {
-			im_panel_update(state);
-			const char *commit = im_engine_commit(state->engine);
-			if (strlen(commit) > 0)
-				im_send_text(state, commit);
-			zwp_input_method_v2_commit(state->input_method, state->im_serial);
-		}
+// End of a dispatch, one commit and one flush for all the events read
+static void im_batch_end(struct wlpinyin_state *state) {
+	im_batch_apply(state);
+	if (state->batch_keys == 0)
+		return;
+	wl_display_flush(state->display);
+
+	// latency from the loop wakeup that read each key to its response flushed
+	uint64_t now = get_microseconds();
+	uint64_t latency = now - state->batch_wakeup_min;
+	state->stats.keys += state->batch_keys;
+	state->stats.key_latency_us_sum +=
+			now * state->batch_keys - state->batch_wakeup_sum;
+	if (latency > state->stats.key_latency_us_max)
+		state->stats.key_latency_us_max = latency;
+	uint64_t event_latency = now - state->batch_event_min;
+	state->stats.event_latency_us_sum +=
+			now * state->batch_keys - state->batch_event_sum;
+	if (event_latency > state->stats.event_latency_us_max)
+		state->stats.event_latency_us_max = event_latency;
+	wlpinyin_dbg("key_latency: max %" PRIu64 "us, from event %" PRIu64
+							 "us, %d keys",
+							 latency, event_latency, state->batch_keys);
+	state->batch_keys = 0;
+	state->batch_wakeup_sum = 0;
+	state->batch_wakeup_min = UINT64_MAX;
+	state->batch_event_sum = 0;
+	state->batch_event_min = UINT64_MAX;
+}
+
+static void im_repeat_stop(struct wlpinyin_state *state) {
+	if (state->repeat_keycode == 0)
+		return;
+	loop_timer_arm(&state->repeat_timer, 0, 0);
+	state->repeat_keycode = 0;
+	state->repeat_backlog = 0;
+}
+
+static void im_forward_key(struct wlpinyin_state *state,
+													 const struct key_item *item) {
+	// Forwarded keys must not overtake text the batch has not committed
+	if (state->batch_commit != NULL) {
+		if (key_queue_idle(state->keys))
+			im_batch_apply(state);
+		else
+			im_batch_commit(state);
 	}
 
-	if (!handled) {
 #ifndef NDEBUG
-		char buf[512] = {0};
-		xkb_keysym_get_name(keynode->xkb_keysym, buf, sizeof buf);
-		wlpinyin_dbg("send_key[%s]: keysym %02x, %s", buf, keynode->xkb_keysym,
-								 keynode->pressed ? "pressed" : "released");
+	char buf[512] = {0};
+	xkb_keysym_get_name(item->keysym, buf, sizeof buf);
+	wlpinyin_dbg("send_key[%s]: keysym %02x, %s", buf, item->keysym,
+							 item->pressed ? "pressed" : "released");
 #endif
 
-		zwp_virtual_keyboard_v1_key(
-				state->virtual_keyboard, get_miliseconds(), keynode->keycode,
-				keynode->pressed ? WL_KEYBOARD_KEY_STATE_PRESSED
-												 : WL_KEYBOARD_KEY_STATE_RELEASED);
+	zwp_virtual_keyboard_v1_key(state->virtual_keyboard, get_miliseconds(),
+															item->keycode,
+															item->pressed ? WL_KEYBOARD_KEY_STATE_PRESSED
+																						: WL_KEYBOARD_KEY_STATE_RELEASED);
+}
+
+// Rime gave up a held key, at once or partway through a folded repeat. The
+// client gets each press rime did not take as a press and release of its
+// own, the last press stays down so it repeats it from there.
+static void im_forward_rejected(struct wlpinyin_state *state,
+																const struct key_item *item) {
+	if (item->keycode == state->repeat_keycode)
+		im_repeat_stop(state);
+	struct key_item key = *item;
+	for (int i = 0; i < item->rejected; i++) {
+		key.pressed = true;
+		im_forward_key(state, &key);
+		if (i + 1 == item->rejected)
+			break;
+		key.pressed = false;
+		im_forward_key(state, &key);
 	}
+}
 
-	wl_display_flush(state->display);
+// Answer an event, in the order it was read
+static void im_key_done(struct wlpinyin_state *state,
+												const struct key_item *item) {
+	if (item->job == KEY_JOB_MODIFIERS) {
+		zwp_virtual_keyboard_v1_modifiers(state->virtual_keyboard, item->mods,
+																			item->latched, item->locked,
+																			item->group);
+		return;
+	}
+
+	if (item->job == KEY_JOB_RESET) {
+		// (De)activation resets the client's input method state
+		im_sent_preedit_store(state, "");
+		state->sent_begin = 0;
+		state->sent_end = 0;
+	}
+
+	if (item->repeats > 0)
+		state->repeat_inflight = false;
+	// Rime gave the key up, the client repeats what it is forwarded itself
+	if (!item->handled && item->job == KEY_JOB_KEY &&
+			item->keycode == state->repeat_keycode)
+		im_repeat_stop(state);
+
+	if (item->handled) {
+		if (item->commit != NULL)
+			state->batch_commit = arena_append(
+					&state->batch_arena, state->batch_commit, "%s", item->commit);
+		state->batch_handled = true;
+		if (item->rejected > 0)
+			im_forward_rejected(state, item);
+	} else if (item->rejected > 0) {
+		// a folded repeat rime never took is still that many presses
+		im_forward_rejected(state, item);
+	} else if (item->job != KEY_JOB_RESET) {
+		im_forward_key(state, item);
+	}
+	if (item->job == KEY_JOB_RESET)
+		return;
+
+	state->batch_keys++;
+	state->batch_wakeup_sum += item->wakeup_us;
+	if (item->wakeup_us < state->batch_wakeup_min)
+		state->batch_wakeup_min = item->wakeup_us;
+	state->batch_event_sum += item->event_us;
+	if (item->event_us < state->batch_event_min)
+		state->batch_event_min = item->event_us;
+
+	// Rime time is only known for keys that went through the worker
+	if (item->done_us == 0)
+		return;
+	uint64_t latency = item->done_us - item->wakeup_us;
+	if (latency > (uint64_t)KEY_BUDGET_MS * 1000) {
+		state->stats.stalls++;
+		wlpinyin_info("stall: keysym %#x answered after %" PRIu64
+									"ms, %" PRIu64 "ms in rime",
+									item->keysym, latency / 1000, item->rime_us / 1000);
+	}
+	if (latency > state->stats.stall_us_max)
+		state->stats.stall_us_max = latency;
+}
+
+// Wait for the worker and answer every queued event
+static void im_queue_drain(struct wlpinyin_state *state) {
+	key_queue_sync(state->keys);
+	struct key_item *item;
+	while ((item = key_queue_peek(state->keys)) != NULL) {
+		im_key_done(state, item);
+		key_queue_pop(state->keys);
+	}
+}
+
+static void im_queue_push(struct wlpinyin_state *state,
+													const struct key_item *item) {
+	if (key_queue_push(state->keys, item))
+		return;
+
+	// Full, answer everything before queueing more
+	im_queue_drain(state);
+	key_queue_push(state->keys, item);
+}
+
+// Repeat a press rime takes while it is held, any other press cancels it
+static void im_repeat_track(struct wlpinyin_state *state,
+														const struct key_item *item) {
+	if (!item->pressed) {
+		if (item->keycode == state->repeat_keycode)
+			im_repeat_stop(state);
+		return;
+	}
+
+	im_repeat_stop(state);
+	if (item->job != KEY_JOB_KEY || state->repeat_rate <= 0 ||
+			!xkb_keymap_key_repeats(state->keymap->keymap, item->keycode + 8))
+		return;
+	state->repeat_keycode = item->keycode;
+	state->repeat_keysym = item->keysym;
+	int interval = 1000 / state->repeat_rate;
+	if (interval == 0)
+		interval = 1;
+	loop_timer_arm(&state->repeat_timer,
+								 state->repeat_delay > 0 ? state->repeat_delay : interval,
+								 interval);
+}
+
+// In ascii mode rime still takes its switch keys (shift, caps lock) and
+// hotkeys (F4, control+grave), it only ignores plain text between
+// compositions. Those keys skip it.
+static bool im_key_plain(struct wlpinyin_state *state, xkb_keysym_t keysym) {
+	if (keysym < XKB_KEY_space || keysym > XKB_KEY_asciitilde)
+		return false;
+	return !xkb_state_mod_name_is_active(state->xkb_state, XKB_MOD_NAME_CTRL,
+																			 XKB_STATE_MODS_EFFECTIVE) &&
+				 !xkb_state_mod_name_is_active(state->xkb_state, XKB_MOD_NAME_ALT,
+																			 XKB_STATE_MODS_EFFECTIVE) &&
+				 !xkb_state_mod_name_is_active(state->xkb_state, XKB_MOD_NAME_LOGO,
+																			 XKB_STATE_MODS_EFFECTIVE);
+}
+
+// Presses that piled up go to rime as one item, read once by the panel
+static void im_repeat_push(struct wlpinyin_state *state, uint64_t presses) {
+	uint64_t now = get_microseconds();
+	struct key_item item = {
+			.job = KEY_JOB_KEY,
+			.keycode = state->repeat_keycode,
+			.keysym = state->repeat_keysym,
+			.pressed = true,
+			.repeats = presses > INT_MAX ? INT_MAX : (int)presses,
+			.plain = im_key_plain(state, state->repeat_keysym),
+			.mods = xkb_state_serialize_mods(
+					state->xkb_state,
+					XKB_STATE_MODS_EFFECTIVE | XKB_STATE_LAYOUT_EFFECTIVE),
+			.wakeup_us = now,
+			.event_us = now,  // repeats are generated here
+	};
+	state->repeat_inflight = true;
+	state->repeat_backlog = 0;
+	im_queue_push(state, &item);
+}
+
+static void im_handle_key(struct wlpinyin_state *state,
+													struct wlpinyin_key *keynode) {
+	if (state->xkb_state == NULL)
+		return;
+
+	// A focus change read before this key resets the engine first
+	if (state->batch_focus) {
+		if (key_queue_empty(state->keys)) {
+			im_batch_apply(state);
+		} else {
+			state->batch_focus = false;
+			im_queue_push(state, &(struct key_item){.job = KEY_JOB_RESET});
+		}
+	}
+
+	struct key_item item = {
+			.job = KEY_JOB_FORWARD,
+			.keycode = keynode->keycode,
+			.keysym = keynode->xkb_keysym,
+			.pressed = keynode->pressed,
+			.plain = im_key_plain(state, keynode->xkb_keysym),
+			.wakeup_us = state->wakeup_us,
+			.event_us = keynode->event_us,
+	};
+	if (state->im_activated && state->im_enabled &&
+			state->im_mode == IM_MODE_RIME) {
+		if (im_toggle(state->xkb_state, keynode->xkb_keysym, keynode->pressed))
+			item.job = KEY_JOB_TOGGLE;
+		else if (keynode->pressed)
+			item.job = KEY_JOB_KEY;
+	}
+
+	// Nothing in flight and nothing for rime to do, answer right away. Rime
+	// rejects plain keys in ascii mode unless it still composes.
+	if (key_queue_empty(state->keys)) {
+		bool bypass = item.job == KEY_JOB_FORWARD;
+		if (item.job == KEY_JOB_KEY)
+			bypass = !im_engine_ready(state->engine) ||
+							 (item.plain && im_engine_get_ascii_mode(state->engine) &&
+								im_engine_preedit(state->engine).text[0] == '\0');
+		if (item.job == KEY_JOB_TOGGLE)
+			bypass = !im_engine_ready(state->engine);
+		if (bypass) {
+			item.job = KEY_JOB_FORWARD;
+			im_repeat_track(state, &item);
+			im_key_done(state, &item);
+			return;
+		}
+	}
+
+	im_repeat_track(state, &item);
+	if (item.job == KEY_JOB_KEY)
+		item.mods = xkb_state_serialize_mods(
+				state->xkb_state,
+				XKB_STATE_MODS_EFFECTIVE | XKB_STATE_LAYOUT_EFFECTIVE);
+	im_queue_push(state, &item);
 }
 
 static void handle_keymap(
@@ -87,26 +420,35 @@ static void handle_keymap(
 	wlpinyin_dbg("ev_keymap: format %d, size %d, fd %d", format, size, fd);
 
 	char *keymap_string = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
-	if (state->xkb_keymap_string != NULL &&
-			!strcmp(keymap_string, state->xkb_keymap_string)) {
-		munmap(keymap_string, size);
+	if (keymap_string == MAP_FAILED) {
+		wlpinyin_err("failed to map keymap: %s", strerror(errno));
+		close(fd);
 		return;
 	}
 
-	xkb_state_unref(state->xkb_state);
-	xkb_keymap_unref(state->xkb_keymap);
-	if (state->xkb_keymap_string != NULL)
-		free(state->xkb_keymap_string);
-
-	state->xkb_keymap_string = strdup(keymap_string);
-	state->xkb_keymap =
-			xkb_keymap_new_from_string(state->xkb_context, state->xkb_keymap_string,
-																 format, XKB_KEYMAP_COMPILE_NO_FLAGS);
-	state->xkb_state = xkb_state_new(state->xkb_keymap);
-
+	// Compositors resend keymaps on layout switches, known ones are reused
+	struct keymap_entry *keymap =
+			keymap_cache_get(state, keymap_string, size, format);
 	munmap(keymap_string, size);
+	if (keymap == NULL) {
+		close(fd);
+		return;
+	}
+	if (keymap != state->keymap) {
+		if (state->xkb_state)
+			xkb_state_unref(state->xkb_state);
+		state->keymap = keymap;
+		state->xkb_state = xkb_state_new(keymap->keymap);
+		state->keysym_row = keymap_cache_row(keymap, state->xkb_state);
+	}
 
-	zwp_virtual_keyboard_v1_keymap(state->virtual_keyboard, format, fd, size);
+	// Keys still with the worker are forwarded under the previous keymap
+	if (keymap->hash != state->keymap_uploaded) {
+		im_queue_drain(state);
+		zwp_virtual_keyboard_v1_keymap(state->virtual_keyboard, format, fd, size);
+		state->keymap_uploaded = keymap->hash;
+	}
+	close(fd);
 }
 
 static void handle_key(
@@ -119,14 +461,31 @@ static void handle_key(
 	UNUSED(zwp_input_method_keyboard_grab_v2);
 	struct wlpinyin_state *state = data;
 
+	if (state->xkb_state == NULL)
+		return;
+
 	struct wlpinyin_key keynode = {0};
 	keynode.keycode = key;
+	// Compositors stamp keys with CLOCK_MONOTONIC in ms. Ages that make no
+	// sense mean another clock, count from the wakeup then.
+	uint32_t age_ms = (uint32_t)(state->wakeup_us / 1000) - time;
+	keynode.event_us = state->wakeup_us;
+	if (age_ms < 60 * 1000)
+		keynode.event_us -= (uint64_t)age_ms * 1000;
 	xkb_keycode_t xkb_keycode = key + 8;
-	keynode.xkb_keysym = xkb_state_key_get_one_sym(state->xkb_state, xkb_keycode);
+	const struct keymap_entry *keymap = state->keymap;
+	if (state->keysym_row != NULL && xkb_keycode >= keymap->min_keycode &&
+			xkb_keycode <= keymap->max_keycode)
+		keynode.xkb_keysym =
+				state->keysym_row[xkb_keycode - keymap->min_keycode];
+	else
+		keynode.xkb_keysym =
+				xkb_state_key_get_one_sym(state->xkb_state, xkb_keycode);
 	keynode.pressed = kstate == WL_KEYBOARD_KEY_STATE_PRESSED;
 
-	xkb_state_update_key(state->xkb_state, xkb_keycode,
-											 keynode.pressed ? XKB_KEY_DOWN : XKB_KEY_UP);
+	if (xkb_state_update_key(state->xkb_state, xkb_keycode,
+													 keynode.pressed ? XKB_KEY_DOWN : XKB_KEY_UP) != 0)
+		state->keysym_row = keymap_cache_row(state->keymap, state->xkb_state);
 
 #ifndef NDEBUG
 	char buf[512] = {0};
@@ -136,8 +495,12 @@ static void handle_key(
 							 keynode.pressed ? "pressed" : "released");
 #endif
 
-	// handle it
+	// handle it, the response goes out when the dispatch ends
 	im_handle_key(state, &keynode);
+
+	// fetch the next candidate pages once typing settles
+	if (state->im_mode == IM_MODE_RIME)
+		loop_timer_arm(&state->prefetch_timer, PREFETCH_DELAY_MS, 0);
 }
 
 static void handle_modifiers(
@@ -154,10 +517,53 @@ static void handle_modifiers(
 			"ev_modifiers: serial %d, depressed %d, latched %d, locked %d, group "
 			"%d",
 			serial, mods_depressed, mods_latched, mods_locked, group);
+	if (state->xkb_state == NULL)
+		return;
 	xkb_state_update_mask(state->xkb_state, mods_depressed, mods_latched,
 												mods_locked, 0, 0, group);
-	zwp_virtual_keyboard_v1_modifiers(state->virtual_keyboard, mods_depressed,
-																		mods_latched, mods_locked, group);
+	state->keysym_row = keymap_cache_row(state->keymap, state->xkb_state);
+
+	// Keys still with the worker were pressed under the previous modifiers
+	struct key_item item = {
+			.job = KEY_JOB_MODIFIERS,
+			.mods = mods_depressed,
+			.latched = mods_latched,
+			.locked = mods_locked,
+			.group = group,
+	};
+	if (key_queue_empty(state->keys))
+		im_key_done(state, &item);
+	else
+		im_queue_push(state, &item);
+}
+
+static void handle_repeat_info(
+		void *data,
+		struct zwp_input_method_keyboard_grab_v2 *zwp_input_method_keyboard_grab_v2,
+		int32_t rate,
+		int32_t delay) {
+	UNUSED(zwp_input_method_keyboard_grab_v2);
+	struct wlpinyin_state *state = data;
+	wlpinyin_dbg("ev_repeat_info: rate %d, delay %d", rate, delay);
+	state->repeat_rate = rate;
+	state->repeat_delay = delay;
+	if (rate <= 0)
+		im_repeat_stop(state);
+}
+
+static void handle_repeat_timer(struct wlpinyin_state *state,
+																uint64_t expirations,
+																void *data) {
+	UNUSED(data);
+	if (state->repeat_keycode == 0)
+		return;
+
+	// Rime is behind, fold these into the next repeat item
+	if (state->repeat_inflight) {
+		state->repeat_backlog += expirations;
+		return;
+	}
+	im_repeat_push(state, expirations);
 }
 
 static void handle_deactivate(void *data,
@@ -165,8 +571,8 @@ static void handle_deactivate(void *data,
 	UNUSED(zwp_input_method_v2);
 	struct wlpinyin_state *state = data;
 	wlpinyin_dbg("ev_deactive");
-	im_engine_reset(state->engine);
-	im_panel_update(state);
+	im_repeat_stop(state);
+	state->batch_focus = true;
 	state->im_activated = false;
 	state->im_enabled = false;
 }
@@ -176,10 +582,24 @@ static void handle_activate(void *data,
 	UNUSED(zwp_input_method_v2);
 	struct wlpinyin_state *state = data;
 	wlpinyin_dbg("ev_active");
-	im_engine_reset(state->engine);
-	im_panel_update(state);
+	im_repeat_stop(state);
+	state->batch_focus = true;
 	state->im_activated = true;
 	state->im_enabled = true;
+	// a field that sends no content type is plain text
+	state->content_hint = 0;
+	state->content_purpose = 0;
+}
+
+static void handle_content_type(void *data,
+																struct zwp_input_method_v2 *zwp_input_method_v2,
+																uint32_t hint,
+																uint32_t purpose) {
+	UNUSED(zwp_input_method_v2);
+	struct wlpinyin_state *state = data;
+	wlpinyin_dbg("ev_content_type: hint %x, purpose %u", hint, purpose);
+	state->content_hint = hint;
+	state->content_purpose = purpose;
 }
 
 static void handle_done(void *data,
@@ -187,6 +607,17 @@ static void handle_done(void *data,
 	UNUSED(zwp_input_method_v2);
 	struct wlpinyin_state *state = data;
 	state->im_serial++;
+
+	enum im_mode mode =
+			im_content_mode(state->content_hint, state->content_purpose);
+	if (mode == state->im_mode)
+		return;
+	wlpinyin_dbg("im_mode: %s",
+							 mode == IM_MODE_RIME ? "rime" : "passthrough");
+	// drop what was composed for the old field, the panel hides with it
+	if (mode == IM_MODE_PASSTHROUGH)
+		state->batch_focus = true;
+	state->im_mode = mode;
 }
 
 static void handle_global(void *data,
@@ -210,19 +641,170 @@ static void handle_global(void *data,
 	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
 		state->wl_shm =
 				wl_registry_bind(registry, name, &wl_shm_interface, version);
+	} else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
+		state->subcompositor =
+				wl_registry_bind(registry, name, &wl_subcompositor_interface, 1);
 	}
 }
 
-struct wlpinyin_state *im_setup(int signalfd, struct wl_display *display) {
-	struct wlpinyin_state *state = calloc(1, sizeof(struct wlpinyin_state));
-	if (state == NULL) {
-		wlpinyin_err("failed to calloc state");
-		return NULL;
+static void handle_signal(struct wlpinyin_state *state,
+													uint32_t events,
+													void *data) {
+	UNUSED(events);
+	UNUSED(data);
+	struct signalfd_siginfo info = {0};
+	if (read(state->signalfd, &info, sizeof(info)) != sizeof(info))
+		return;
+	switch (info.ssi_signo) {
+	case SIGINT:
+	case SIGTERM:
+		state->running = false;
+		break;
 	}
-	state->signalfd = signalfd;
-	state->display = display;
-	state->im_enabled = true;
+	wlpinyin_dbg("signal: %d, running: %d", info.ssi_signo, state->running);
+}
+
+static void handle_wayland(struct wlpinyin_state *state,
+													 uint32_t events,
+													 void *data) {
+	UNUSED(data);
+	state->wakeup_us = get_microseconds();
+
+	// Keys are dispatched right after they are read
+	if (events & EPOLLIN) {
+		state->wayland_reading = false;
+		if (wl_display_read_events(state->display) == -1) {
+			wlpinyin_err("failed to read wayland events: %s", strerror(errno));
+			goto fail;
+		}
+	}
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		wlpinyin_err("wayland connection closed");
+		goto fail;
+	}
+	if (wl_display_dispatch_pending(state->display) == -1)
+		goto fail;
+	im_batch_end(state);
+	return;
+
+fail:
+	state->running = false;
+	state->loop_status = -1;
+}
+
+static void handle_key_results(struct wlpinyin_state *state,
+															 uint32_t events,
+															 void *data) {
+	UNUSED(events);
+	UNUSED(data);
+	uint64_t count;
+	if (read(key_queue_fd(state->keys), &count, sizeof(count)) != sizeof(count))
+		return;
+
+	struct key_item *item;
+	while ((item = key_queue_peek(state->keys)) != NULL) {
+		im_key_done(state, item);
+		key_queue_pop(state->keys);
+	}
+	if (state->repeat_backlog > 0 && !state->repeat_inflight &&
+			state->repeat_keycode != 0)
+		im_repeat_push(state, state->repeat_backlog);
+	im_batch_end(state);
+	// toggles and schema switches typed by the user
+	rpc_notify(state);
+}
+
+static void handle_engine(struct wlpinyin_state *state,
+													uint32_t events,
+													void *data) {
+	UNUSED(events);
+	UNUSED(data);
+	// Deploy results may create the session, not under the worker's feet
+	key_queue_sync(state->keys);
+	enum im_engine_event event = im_engine_dispatch(state->engine);
+	if (event == IM_ENGINE_READY)
+		wlpinyin_info("engine ready");
+	// the panel and preedit follow the new session, sent right away
+	if (event != IM_ENGINE_NONE && state->im_activated) {
+		im_panel_update(state);
+		im_commit(state);
+	}
+	rpc_notify(state);
+}
+
+static void handle_stats(struct wlpinyin_state *state, void *data) {
+	UNUSED(data);
+	const struct wlpinyin_stats *stats = &state->stats;
+	// an idle daemon does not fill the log with the same line
+	if (stats->keys == state->stats_logged_keys)
+		return;
+	state->stats_logged_keys = stats->keys;
+
+	uint64_t mallocs, frees;
+	arena_counters(&mallocs, &frees);
+	wlpinyin_info("stats: keys %" PRIu64 ", key_latency avg %" PRIu64
+								"us max %" PRIu64 "us, from event avg %" PRIu64
+								"us max %" PRIu64 "us, arena mallocs %" PRIu64
+								" frees %" PRIu64 ", measure hits %" PRIu64
+								" misses %" PRIu64 ", frames %" PRIu64 " draw avg %" PRIu64
+								"us max %" PRIu64 "us, suppressed preedits %" PRIu64
+								" commits %" PRIu64 " hides %" PRIu64 ", stalls %" PRIu64
+								" max %" PRIu64 "us",
+								stats->keys,
+								stats->keys ? stats->key_latency_us_sum / stats->keys : 0,
+								stats->key_latency_us_max,
+								stats->keys ? stats->event_latency_us_sum / stats->keys : 0,
+								stats->event_latency_us_max, mallocs, frees,
+								stats->measure_hits, stats->measure_misses, stats->frames,
+								stats->frames ? stats->draw_us_sum / stats->frames : 0,
+								stats->draw_us_max, stats->suppressed_preedits,
+								stats->suppressed_commits, stats->suppressed_hides,
+								stats->stalls, stats->stall_us_max);
+}
+
+static void handle_stats_timer(struct wlpinyin_state *state,
+															 uint64_t expirations,
+															 void *data) {
+	UNUSED(expirations);
+	UNUSED(data);
+	loop_idle_schedule(state, &state->stats_idle);
+}
+
+static void handle_prefetch_timer(struct wlpinyin_state *state,
+																	uint64_t expirations,
+																	void *data) {
+	UNUSED(expirations);
+	UNUSED(data);
+	if (!key_queue_idle(state->keys)) {
+		loop_timer_arm(&state->prefetch_timer, PREFETCH_DELAY_MS, 0);
+		return;
+	}
+	if (im_engine_ready(state->engine))
+		im_engine_prefetch(state->engine);
+}
+
+static void *startup_engine(void *data) {
+	struct wlpinyin_state *state = data;
+	uint64_t start = get_microseconds();
+	state->engine = im_engine_new();
+	wlpinyin_dbg("startup: engine init %" PRIu64 "us",
+							 get_microseconds() - start);
+	UNUSED(start);
+	return NULL;
+}
 
+static void *startup_panel(void *data) {
+	struct wlpinyin_state *state = data;
+	uint64_t start = get_microseconds();
+	int ret = im_panel_warmup(state);
+	wlpinyin_dbg("startup: panel warmup %" PRIu64 "us",
+							 get_microseconds() - start);
+	UNUSED(start);
+	return ret == 0 ? NULL : state;
+}
+
+// Everything that has to run on the wayland thread
+static int im_setup_wayland(struct wlpinyin_state *state) {
 	{
 		struct wl_registry *registry = wl_display_get_registry(state->display);
 		static const struct wl_registry_listener registry_listener = {
@@ -236,7 +818,7 @@ struct wlpinyin_state *im_setup(int signalfd, struct wl_display *display) {
 				state->virtual_keyboard_manager == NULL || state->seat == NULL ||
 				state->compositor == NULL) {
 			wlpinyin_err("required wayland interface not available");
-			goto clean;
+			return -1;
 		}
 	}
 
@@ -245,14 +827,14 @@ struct wlpinyin_state *im_setup(int signalfd, struct wl_display *display) {
 	state->xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
 	if (state->xkb_context == NULL) {
 		wlpinyin_err("failed to setup xkb context");
-		goto clean;
+		return -1;
 	}
 
 	state->input_method = zwp_input_method_manager_v2_get_input_method(
 			state->input_method_manager, state->seat);
 	if (state->input_method == NULL) {
 		wlpinyin_err("failed to setup input_method");
-		goto clean;
+		return -1;
 	}
 
 	state->input_method_keyboard_grab =
@@ -263,9 +845,7 @@ struct wlpinyin_state *im_setup(int signalfd, struct wl_display *display) {
 					.keymap = handle_keymap,
 					.key = handle_key,
 					.modifiers = handle_modifiers,
-					.repeat_info =
-							(void (*)(void *, struct zwp_input_method_keyboard_grab_v2 *,
-												int32_t, int32_t))noop,
+					.repeat_info = handle_repeat_info,
 			};
 	zwp_input_method_keyboard_grab_v2_add_listener(
 			state->input_method_keyboard_grab, &im_activate_listener, state);
@@ -275,7 +855,7 @@ struct wlpinyin_state *im_setup(int signalfd, struct wl_display *display) {
 					state->virtual_keyboard_manager, state->seat);
 	if (state->virtual_keyboard == NULL) {
 		wlpinyin_err("failed to setup virtual keyboard");
-		goto clean;
+		return -1;
 	}
 
 	static const struct zwp_input_method_v2_listener im_listener = {
@@ -285,26 +865,106 @@ struct wlpinyin_state *im_setup(int signalfd, struct wl_display *display) {
 																		const char *, uint32_t, uint32_t))noop,
 			.text_change_cause =
 					(void (*)(void *, struct zwp_input_method_v2 *, uint32_t))noop,
-			.content_type = (void (*)(void *, struct zwp_input_method_v2 *, uint32_t,
-																uint32_t))noop,
+			.content_type = handle_content_type,
 			.done = handle_done,
 			.unavailable = (void (*)(void *, struct zwp_input_method_v2 *))noop,
 	};
 	zwp_input_method_v2_add_listener(state->input_method, &im_listener, state);
 
 	if (im_panel_init(state) != 0)
+		return -1;
+
+	if (rpc_init(state) != 0) {
+		wlpinyin_err("failed to setup rpc socket");
+		return -1;
+	}
+
+	return 0;
+}
+
+struct wlpinyin_state *im_setup(int signalfd, struct wl_display *display) {
+	struct wlpinyin_state *state = calloc(1, sizeof(struct wlpinyin_state));
+	if (state == NULL) {
+		wlpinyin_err("failed to calloc state");
+		return NULL;
+	}
+	state->signalfd = signalfd;
+	state->display = display;
+	state->im_enabled = true;
+	state->stats_timer.source.fd = -1;
+	state->prefetch_timer.source.fd = -1;
+	state->repeat_timer.source.fd = -1;
+	state->keys_source.fd = -1;
+	state->batch_wakeup_min = UINT64_MAX;
+	state->batch_event_min = UINT64_MAX;
+	state->rpc_fd = -1;
+	state->rpc_source.fd = -1;
+	arena_init(&state->frame_arena, 4096);
+	arena_init(&state->batch_arena, 256);
+
+	if (loop_init(state) != 0)
+		goto clean;
+
+	if (loop_add(state, &state->signal_source, state->signalfd, EPOLLIN,
+							 handle_signal, NULL) != 0 ||
+			loop_add(state, &state->wayland_source,
+							 wl_display_get_fd(state->display), EPOLLIN, handle_wayland,
+							 NULL) != 0)
+		goto clean;
+
+	// periodic metrics export, runs when the loop is idle
+	loop_idle_init(&state->stats_idle, handle_stats, NULL);
+	if (loop_timer_init(state, &state->stats_timer, handle_stats_timer, NULL) !=
+			0)
+		goto clean;
+	loop_timer_arm(&state->stats_timer, 60 * 1000, 60 * 1000);
+	if (loop_timer_init(state, &state->prefetch_timer, handle_prefetch_timer,
+											NULL) != 0 ||
+			loop_timer_init(state, &state->repeat_timer, handle_repeat_timer,
+											NULL) != 0)
+		goto clean;
+
+	// Only the wayland setup needs this thread, rime init and font warmup run
+	// concurrently and are joined before any event is dispatched
+	uint64_t startup_us = get_microseconds();
+	bool failed = false;
+	pthread_t engine_thread, panel_thread;
+	bool engine_threaded =
+			pthread_create(&engine_thread, NULL, startup_engine, state) == 0;
+	bool panel_threaded =
+			pthread_create(&panel_thread, NULL, startup_panel, state) == 0;
+
+	if (im_setup_wayland(state) != 0)
+		failed = true;
+
+	if (engine_threaded)
+		pthread_join(engine_thread, NULL);
+	else
+		startup_engine(state);
+	void *panel_ret = NULL;
+	if (panel_threaded)
+		pthread_join(panel_thread, &panel_ret);
+	else
+		panel_ret = startup_panel(state);
+	wlpinyin_info("startup: stages joined in %" PRIu64 "ms",
+								(get_microseconds() - startup_us) / 1000);
+	if (failed || panel_ret != NULL)
 		goto clean;
 
-	state->engine = im_engine_new();
 	if (state->engine == NULL) {
 		wlpinyin_err("failed to setup engine");
 		goto clean;
 	}
+	if (loop_add(state, &state->engine_source, im_engine_fd(state->engine),
+							 EPOLLIN, handle_engine, NULL) != 0)
+		goto clean;
 
-	if (rpc_init(state) != 0) {
-		wlpinyin_err("failed to setup rpc socket");
+	// Rime runs on its own thread from here on, see key_queue.c
+	state->keys = key_queue_new(state->engine);
+	if (state->keys == NULL ||
+			loop_add(state, &state->keys_source, key_queue_fd(state->keys), EPOLLIN,
+							 handle_key_results, NULL) != 0)
 		goto clean;
-	}
 
 	wl_display_roundtrip(state->display);
 	return state;
@@ -315,71 +975,46 @@ clean:
 }
 
 int im_loop(struct wlpinyin_state *state) {
-	enum {
-		fd_signal = 0,
-		fd_wayland,
-		fd_rpc_listen,
-		fd_rpc_client,
-		fd_max,
-	};
+	uint32_t wayland_events = EPOLLIN;
 
-	bool running = true;
-	struct pollfd fds[fd_max] = {0};
-
-	// Initialize fixed fds
-	fds[fd_signal].fd = state->signalfd;
-	fds[fd_signal].events = POLLIN;
-
-	fds[fd_wayland].fd = wl_display_get_fd(state->display);
-	fds[fd_wayland].events = POLLIN;
-
-	fds[fd_rpc_listen].fd = state->rpc_fd;
-	fds[fd_rpc_listen].events = POLLIN;
-
-	fds[fd_rpc_client].fd = -1;  // Will be set when client connects
-	fds[fd_rpc_client].events = POLLIN;
-
-	while (running) {
-		// Update RPC client fd
-		fds[fd_rpc_client].fd = state->rpc_client;
-
-		int ret = poll(fds, fd_max, -1);
-		if (ret == -1) {
-			continue;
-		}
-
-		// Handle signal
-		if (fds[fd_signal].revents & POLLIN) {
-			struct signalfd_siginfo info = {0};
-			read(fds[fd_signal].fd, &info, sizeof(info));
-			switch (info.ssi_signo) {
-			case SIGINT:
-			case SIGTERM:
-				running = false;
-				break;
-			}
-			wlpinyin_dbg("signal: %d, running: %d", info.ssi_signo, running);
+	state->running = true;
+	state->loop_status = 0;
+	while (state->running) {
+		// Drain events queued by a previous read before blocking, otherwise
+		// prepare_read refuses to start a new read
+		while (wl_display_prepare_read(state->display) != 0) {
+			if (wl_display_dispatch_pending(state->display) == -1)
+				return -1;
 		}
+		im_batch_end(state);
+		state->wayland_reading = true;
 
-		// Handle wayland
-		if (fds[fd_wayland].revents & POLLIN) {
-			if (wl_display_roundtrip(state->display) == -1) {
+		// Requests queued by handlers must reach the compositor before we sleep,
+		// wait for EPOLLOUT if the socket buffer is full
+		uint32_t events = EPOLLIN;
+		if (wl_display_flush(state->display) == -1) {
+			if (errno != EAGAIN) {
+				wlpinyin_err("failed to flush display: %s", strerror(errno));
+				wl_display_cancel_read(state->display);
 				return -1;
 			}
+			events |= EPOLLOUT;
 		}
-
-		// Handle RPC client data first (process pending data before accepting new connection)
-		if (fds[fd_rpc_client].fd != -1 && fds[fd_rpc_client].revents & (POLLIN | POLLHUP | POLLERR)) {
-			rpc_handle_client_data(state);
+		if (events != wayland_events) {
+			loop_modify(state, &state->wayland_source, events);
+			wayland_events = events;
 		}
 
-		// Handle new RPC connections
-		if (fds[fd_rpc_listen].revents & POLLIN) {
-			rpc_accept(state);
+		int ret = loop_dispatch(state);
+		if (state->wayland_reading) {
+			wl_display_cancel_read(state->display);
+			state->wayland_reading = false;
 		}
+		if (ret == -1)
+			return -1;
 	}
 
-	return 0;
+	return state->loop_status;
 }
 
 int im_destroy(struct wlpinyin_state *state) {
@@ -387,6 +1022,11 @@ int im_destroy(struct wlpinyin_state *state) {
 		zwp_input_method_keyboard_grab_v2_release(
 				state->input_method_keyboard_grab);
 
+	// The worker goes first, it may still be inside the engine
+	if (state->keys) {
+		loop_remove(state, &state->keys_source);
+		key_queue_free(state->keys);
+	}
 	if (state->engine)
 		im_engine_free(state->engine);
 
@@ -398,16 +1038,20 @@ int im_destroy(struct wlpinyin_state *state) {
 	if (state->input_method)
 		zwp_input_method_v2_destroy(state->input_method);
 
-	if (state->xkb_keymap_string != NULL)
-		free(state->xkb_keymap_string);
 	if (state->xkb_state)
 		xkb_state_unref(state->xkb_state);
-	if (state->xkb_keymap)
-		xkb_keymap_unref(state->xkb_keymap);
+	keymap_cache_finish(state);
 	if (state->xkb_context)
 		xkb_context_unref(state->xkb_context);
 
 	rpc_destroy(state);
+	arena_finish(&state->frame_arena);
+	arena_finish(&state->batch_arena);
+	free(state->sent_preedit);
+	loop_timer_finish(state, &state->stats_timer);
+	loop_timer_finish(state, &state->prefetch_timer);
+	loop_timer_finish(state, &state->repeat_timer);
+	loop_destroy(state);
 	wl_display_flush(state->display);
 	return 0;
 }
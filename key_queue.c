@@ -0,0 +1,224 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wlpinyin.h"
+
+#define KEY_QUEUE_SIZE 256
+
+/*
+ * Single producer, single consumer ring between the wayland thread and the
+ * rime worker. Slots in [read, done) hold results for the main thread, slots
+ * in [done, write) wait for the worker, the rest are free. The engine belongs
+ * to the worker while done != write.
+ */
+struct key_queue {
+	struct key_item items[KEY_QUEUE_SIZE];
+	// commit text of each slot, grown by the worker and reused by later items
+	char *commits[KEY_QUEUE_SIZE];
+	size_t commit_caps[KEY_QUEUE_SIZE];
+	atomic_uint write;  // main thread, next free slot
+	atomic_uint done;   // worker, next slot to process
+	unsigned read;      // main thread, next result to consume
+
+	struct engine *engine;
+	pthread_t thread;
+	bool threaded;
+	atomic_bool quit;
+	sem_t work;  // posted once per pushed item
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;  // the worker caught up with write
+	int fd;                    // eventfd, results are ready
+};
+
+static uint64_t get_microseconds() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+// Copy the commit into the slot's buffer, which only grows
+static void key_queue_keep_commit(struct key_queue *queue,
+																	unsigned slot,
+																	const char *commit) {
+	size_t len = strlen(commit) + 1;
+	if (len > queue->commit_caps[slot]) {
+		size_t cap = queue->commit_caps[slot] ? queue->commit_caps[slot] : 64;
+		while (cap < len)
+			cap *= 2;
+		char *buf = realloc(queue->commits[slot], cap);
+		if (buf == NULL) {
+			wlpinyin_err("failed to keep commit text");
+			return;
+		}
+		queue->commits[slot] = buf;
+		queue->commit_caps[slot] = cap;
+	}
+	memcpy(queue->commits[slot], commit, len);
+	queue->items[slot].commit = queue->commits[slot];
+}
+
+static void key_queue_process(struct key_queue *queue, unsigned slot) {
+	struct engine *engine = queue->engine;
+	struct key_item *item = &queue->items[slot];
+	uint64_t start = get_microseconds();
+
+	item->handled = false;
+	item->rejected = 0;
+	item->commit = NULL;
+	switch (item->job) {
+	case KEY_JOB_KEY: {
+		// Rime rejects plain keys in ascii mode unless it still composes
+		int presses = item->repeats > 0 ? item->repeats : 1;
+		int taken = 0;
+		if (im_engine_ready(engine) &&
+				!(item->plain && im_engine_get_ascii_mode(engine) &&
+					im_engine_preedit(engine).text[0] == '\0'))
+			taken = im_engine_key(engine, item->keysym, item->mods, presses);
+		item->handled = taken > 0;
+		item->rejected = presses - taken;
+		break;
+	}
+	case KEY_JOB_TOGGLE:
+		im_engine_toggle(engine);
+		item->handled = true;
+		break;
+	case KEY_JOB_RESET:
+		im_engine_reset(engine);
+		item->handled = true;
+		break;
+	case KEY_JOB_FORWARD:
+	case KEY_JOB_MODIFIERS:
+		// Nothing for rime, they only keep their place behind earlier keys
+		break;
+	}
+
+	// The commit lives in the engine until the next key, hand over a copy
+	if (item->handled) {
+		const char *commit = im_engine_commit(engine);
+		if (commit[0] != '\0')
+			key_queue_keep_commit(queue, slot, commit);
+	}
+	item->done_us = get_microseconds();
+	item->rime_us = item->done_us - start;
+}
+
+static void *key_queue_thread(void *data) {
+	struct key_queue *queue = data;
+
+	for (;;) {
+		while (sem_wait(&queue->work) == -1 && errno == EINTR)
+			;
+		if (atomic_load(&queue->quit))
+			break;
+
+		unsigned done = atomic_load_explicit(&queue->done, memory_order_relaxed);
+		key_queue_process(queue, done % KEY_QUEUE_SIZE);
+		atomic_store_explicit(&queue->done, done + 1, memory_order_release);
+
+		// Wake a main thread that waits to use the engine itself
+		if (done + 1 ==
+				atomic_load_explicit(&queue->write, memory_order_acquire)) {
+			pthread_mutex_lock(&queue->idle_lock);
+			pthread_cond_broadcast(&queue->idle_cond);
+			pthread_mutex_unlock(&queue->idle_lock);
+		}
+
+		uint64_t one = 1;
+		if (write(queue->fd, &one, sizeof(one)) != sizeof(one))
+			wlpinyin_err("failed to signal key results: %s", strerror(errno));
+	}
+	return NULL;
+}
+
+struct key_queue *key_queue_new(struct engine *engine) {
+	struct key_queue *queue = calloc(1, sizeof(struct key_queue));
+	if (queue == NULL)
+		return NULL;
+
+	queue->engine = engine;
+	atomic_init(&queue->write, 0);
+	atomic_init(&queue->done, 0);
+	atomic_init(&queue->quit, false);
+	sem_init(&queue->work, 0, 0);
+	pthread_mutex_init(&queue->idle_lock, NULL);
+	pthread_cond_init(&queue->idle_cond, NULL);
+
+	queue->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (queue->fd == -1) {
+		wlpinyin_err("failed to create key queue eventfd");
+		key_queue_free(queue);
+		return NULL;
+	}
+	if (pthread_create(&queue->thread, NULL, key_queue_thread, queue) != 0) {
+		wlpinyin_err("failed to start rime worker");
+		key_queue_free(queue);
+		return NULL;
+	}
+	queue->threaded = true;
+	return queue;
+}
+
+void key_queue_free(struct key_queue *queue) {
+	if (queue->threaded) {
+		atomic_store(&queue->quit, true);
+		sem_post(&queue->work);
+		pthread_join(queue->thread, NULL);
+	}
+	for (int i = 0; i < KEY_QUEUE_SIZE; i++)
+		free(queue->commits[i]);
+	if (queue->fd != -1)
+		close(queue->fd);
+	pthread_cond_destroy(&queue->idle_cond);
+	pthread_mutex_destroy(&queue->idle_lock);
+	sem_destroy(&queue->work);
+	free(queue);
+}
+
+int key_queue_fd(struct key_queue *queue) {
+	return queue->fd;
+}
+
+bool key_queue_push(struct key_queue *queue, const struct key_item *item) {
+	unsigned write = atomic_load_explicit(&queue->write, memory_order_relaxed);
+	if (write - queue->read == KEY_QUEUE_SIZE)
+		return false;
+
+	queue->items[write % KEY_QUEUE_SIZE] = *item;
+	atomic_store_explicit(&queue->write, write + 1, memory_order_release);
+	sem_post(&queue->work);
+	return true;
+}
+
+struct key_item *key_queue_peek(struct key_queue *queue) {
+	if (queue->read == atomic_load_explicit(&queue->done, memory_order_acquire))
+		return NULL;
+	return &queue->items[queue->read % KEY_QUEUE_SIZE];
+}
+
+void key_queue_pop(struct key_queue *queue) {
+	queue->read++;
+}
+
+bool key_queue_idle(struct key_queue *queue) {
+	return atomic_load_explicit(&queue->done, memory_order_acquire) ==
+				 atomic_load_explicit(&queue->write, memory_order_relaxed);
+}
+
+bool key_queue_empty(struct key_queue *queue) {
+	return queue->read ==
+				 atomic_load_explicit(&queue->write, memory_order_relaxed);
+}
+
+void key_queue_sync(struct key_queue *queue) {
+	pthread_mutex_lock(&queue->idle_lock);
+	while (!key_queue_idle(queue))
+		pthread_cond_wait(&queue->idle_cond, &queue->idle_lock);
+	pthread_mutex_unlock(&queue->idle_lock);
+}
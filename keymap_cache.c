@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "wlpinyin.h"
+
+// Keys are mostly typed under these, the rest go through xkb_state
+static const char *const row_mod_names[KEYMAP_ROWS][2] = {
+		{NULL, NULL},
+		{XKB_MOD_NAME_SHIFT, NULL},
+		{XKB_MOD_NAME_CAPS, NULL},
+		{XKB_MOD_NAME_NUM, NULL},
+		{XKB_MOD_NAME_SHIFT, XKB_MOD_NAME_NUM},
+		{XKB_MOD_NAME_CAPS, XKB_MOD_NAME_NUM},
+};
+
+// FNV-1a over 8 byte words, keymaps are several kilobytes
+static uint64_t keymap_hash(const char *data, size_t size) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		hash ^= word;
+		hash *= 0x100000001b3ULL;
+	}
+	for (; i < size; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static void keymap_entry_clear(struct keymap_entry *entry) {
+	if (entry->keymap != NULL)
+		xkb_keymap_unref(entry->keymap);
+	free(entry->syms);
+	memset(entry, 0, sizeof(*entry));
+}
+
+static bool keymap_entry_fill(struct keymap_entry *entry) {
+	struct xkb_keymap *keymap = entry->keymap;
+	entry->min_keycode = xkb_keymap_min_keycode(keymap);
+	entry->max_keycode = xkb_keymap_max_keycode(keymap);
+	int nkeys = entry->max_keycode - entry->min_keycode + 1;
+	entry->syms = calloc((size_t)KEYMAP_ROWS * nkeys, sizeof(xkb_keysym_t));
+	if (entry->syms == NULL)
+		return false;
+
+	xkb_mod_index_t caps = xkb_keymap_mod_get_index(keymap, XKB_MOD_NAME_CAPS);
+	for (int row = 0; row < KEYMAP_ROWS; row++) {
+		xkb_mod_mask_t mods = 0;
+		for (int i = 0; i < 2 && row_mod_names[row][i] != NULL; i++) {
+			xkb_mod_index_t idx =
+					xkb_keymap_mod_get_index(keymap, row_mod_names[row][i]);
+			if (idx == XKB_MOD_INVALID)
+				mods = XKB_MOD_INVALID;  // never matches an effective mask
+			else if (mods != XKB_MOD_INVALID)
+				mods |= 1u << idx;
+		}
+		entry->row_mods[row] = mods;
+		if (mods == XKB_MOD_INVALID)
+			continue;
+
+		// Caps lock is a locked modifier, the others are held
+		xkb_mod_mask_t locked = caps != XKB_MOD_INVALID ? mods & 1u << caps : 0;
+		struct xkb_state *scratch = xkb_state_new(keymap);
+		if (scratch == NULL)
+			return false;
+		xkb_state_update_mask(scratch, mods & ~locked, 0, locked, 0, 0, 0);
+		xkb_keysym_t *syms = entry->syms + (size_t)row * nkeys;
+		for (int i = 0; i < nkeys; i++)
+			syms[i] = xkb_state_key_get_one_sym(scratch, entry->min_keycode + i);
+		xkb_state_unref(scratch);
+	}
+	return true;
+}
+
+struct keymap_entry *keymap_cache_get(struct wlpinyin_state *state,
+																			const char *string,
+																			size_t size,
+																			uint32_t format) {
+	uint64_t hash = keymap_hash(string, size);
+	struct keymap_entry *victim = NULL;
+	for (int i = 0; i < KEYMAP_CACHE_SIZE; i++) {
+		struct keymap_entry *entry = &state->keymaps[i];
+		if (entry->keymap != NULL && entry->hash == hash && entry->size == size) {
+			entry->used = ++state->keymap_stamp;
+			return entry;
+		}
+		// Free slots first, then the least recently used, never the current one
+		if (entry == state->keymap)
+			continue;
+		if (victim == NULL ||
+				(victim->keymap != NULL &&
+				 (entry->keymap == NULL || entry->used < victim->used)))
+			victim = entry;
+	}
+
+	keymap_entry_clear(victim);
+	victim->keymap = xkb_keymap_new_from_buffer(
+			state->xkb_context, string, strnlen(string, size), format,
+			XKB_KEYMAP_COMPILE_NO_FLAGS);
+	if (victim->keymap == NULL || !keymap_entry_fill(victim)) {
+		wlpinyin_err("failed to compile keymap");
+		keymap_entry_clear(victim);
+		return NULL;
+	}
+	victim->hash = hash;
+	victim->size = size;
+	victim->used = ++state->keymap_stamp;
+	return victim;
+}
+
+const xkb_keysym_t *keymap_cache_row(const struct keymap_entry *entry,
+																		 struct xkb_state *xkb) {
+	if (entry == NULL || xkb == NULL ||
+			xkb_state_serialize_layout(xkb, XKB_STATE_LAYOUT_EFFECTIVE) != 0)
+		return NULL;
+
+	xkb_mod_mask_t mods = xkb_state_serialize_mods(xkb, XKB_STATE_MODS_EFFECTIVE);
+	int nkeys = entry->max_keycode - entry->min_keycode + 1;
+	for (int row = 0; row < KEYMAP_ROWS; row++) {
+		if (entry->row_mods[row] == mods)
+			return entry->syms + (size_t)row * nkeys;
+	}
+	return NULL;
+}
+
+void keymap_cache_finish(struct wlpinyin_state *state) {
+	for (int i = 0; i < KEYMAP_CACHE_SIZE; i++)
+		keymap_entry_clear(&state->keymaps[i]);
+	state->keymap = NULL;
+}
@@ -0,0 +1,199 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "wlpinyin.h"
+
+#define MAX_EVENTS 16
+
+int loop_init(struct wlpinyin_state *state) {
+	state->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (state->epoll_fd == -1) {
+		wlpinyin_err("failed to create epoll: %s", strerror(errno));
+		return -1;
+	}
+	state->idle_head = NULL;
+	state->idle_tail = NULL;
+	return 0;
+}
+
+void loop_destroy(struct wlpinyin_state *state) {
+	if (state->epoll_fd != -1) {
+		close(state->epoll_fd);
+		state->epoll_fd = -1;
+	}
+}
+
+int loop_add(struct wlpinyin_state *state,
+						 struct loop_source *source,
+						 int fd,
+						 uint32_t events,
+						 loop_fd_cb cb,
+						 void *data) {
+	source->fd = fd;
+	source->cb = cb;
+	source->data = data;
+
+	struct epoll_event ev = {.events = events, .data.ptr = source};
+	if (epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		wlpinyin_err("failed to watch fd %d: %s", fd, strerror(errno));
+		source->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+int loop_modify(struct wlpinyin_state *state,
+								struct loop_source *source,
+								uint32_t events) {
+	struct epoll_event ev = {.events = events, .data.ptr = source};
+	return epoll_ctl(state->epoll_fd, EPOLL_CTL_MOD, source->fd, &ev);
+}
+
+void loop_remove(struct wlpinyin_state *state, struct loop_source *source) {
+	if (source->fd == -1)
+		return;
+	epoll_ctl(state->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+	source->fd = -1;
+}
+
+static void loop_handle_timer(struct wlpinyin_state *state,
+															uint32_t events,
+															void *data) {
+	UNUSED(events);
+	struct loop_timer *timer = data;
+
+	uint64_t expirations = 0;
+	if (read(timer->source.fd, &expirations, sizeof(expirations)) !=
+					sizeof(expirations) ||
+			expirations == 0)
+		return;
+
+	timer->cb(state, expirations, timer->data);
+}
+
+int loop_timer_init(struct wlpinyin_state *state,
+										struct loop_timer *timer,
+										loop_timer_cb cb,
+										void *data) {
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		wlpinyin_err("failed to create timerfd: %s", strerror(errno));
+		return -1;
+	}
+
+	timer->cb = cb;
+	timer->data = data;
+	if (loop_add(state, &timer->source, fd, EPOLLIN, loop_handle_timer,
+							 timer) != 0) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+void loop_timer_arm(struct loop_timer *timer, int delay_ms, int interval_ms) {
+	struct itimerspec spec = {
+			.it_value =
+					{
+							.tv_sec = delay_ms / 1000,
+							.tv_nsec = (delay_ms % 1000) * 1000 * 1000,
+					},
+			.it_interval =
+					{
+							.tv_sec = interval_ms / 1000,
+							.tv_nsec = (interval_ms % 1000) * 1000 * 1000,
+					},
+	};
+	timerfd_settime(timer->source.fd, 0, &spec, NULL);
+}
+
+void loop_timer_finish(struct wlpinyin_state *state, struct loop_timer *timer) {
+	int fd = timer->source.fd;
+	if (fd == -1)
+		return;
+	loop_remove(state, &timer->source);
+	close(fd);
+}
+
+void loop_idle_init(struct loop_idle *idle, loop_idle_cb cb, void *data) {
+	idle->cb = cb;
+	idle->data = data;
+	idle->queued = false;
+	idle->next = NULL;
+}
+
+void loop_idle_schedule(struct wlpinyin_state *state, struct loop_idle *idle) {
+	if (idle->queued)
+		return;
+
+	idle->queued = true;
+	idle->next = NULL;
+	if (state->idle_tail)
+		state->idle_tail->next = idle;
+	else
+		state->idle_head = idle;
+	state->idle_tail = idle;
+}
+
+void loop_idle_cancel(struct wlpinyin_state *state, struct loop_idle *idle) {
+	if (!idle->queued)
+		return;
+
+	struct loop_idle **link = &state->idle_head;
+	struct loop_idle *prev = NULL;
+	while (*link != idle) {
+		prev = *link;
+		link = &(*link)->next;
+	}
+	*link = idle->next;
+	if (state->idle_tail == idle)
+		state->idle_tail = prev;
+	idle->queued = false;
+	idle->next = NULL;
+}
+
+static void loop_run_idle(struct wlpinyin_state *state) {
+	// Only run what is queued now, tasks scheduled by these callbacks wait for
+	// the next quiet iteration
+	int count = 0;
+	for (struct loop_idle *idle = state->idle_head; idle; idle = idle->next)
+		count++;
+
+	while (count-- > 0 && state->idle_head) {
+		struct loop_idle *idle = state->idle_head;
+		state->idle_head = idle->next;
+		if (state->idle_head == NULL)
+			state->idle_tail = NULL;
+		idle->queued = false;
+		idle->next = NULL;
+		idle->cb(state, idle->data);
+	}
+}
+
+int loop_dispatch(struct wlpinyin_state *state) {
+	struct epoll_event events[MAX_EVENTS];
+
+	// Idle work must not delay input, so only poll when some is queued and run
+	// it when nothing is ready
+	int timeout = state->idle_head ? 0 : -1;
+	int n = epoll_wait(state->epoll_fd, events, MAX_EVENTS, timeout);
+	if (n == -1) {
+		if (errno == EINTR)
+			return 0;
+		wlpinyin_err("epoll_wait failed: %s", strerror(errno));
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		struct loop_source *source = events[i].data.ptr;
+		source->cb(state, events[i].events, source->data);
+	}
+
+	if (n == 0)
+		loop_run_idle(state);
+
+	return 0;
+}
@@ -0,0 +1,213 @@
+#ifdef ENABLE_POPUP
+
+#include <cairo.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wlpinyin.h"
+
+#define CAND_CACHE_SIZE 512
+#define CAND_BUCKETS 1024
+#define CAND_KEY_MAX 96
+#define CAND_TILE_BUDGET (4 * 1024 * 1024)
+
+struct cand_entry {
+	uint64_t hash;
+	int len;
+	char key[CAND_KEY_MAX];
+	PangoRectangle rect;
+	cairo_surface_t *tile;  // rasterized text over the panel background
+	cairo_surface_t *clear_tile;  // over nothing, for the highlighted cell
+	int chain;              // next entry in the same bucket
+	int prev, next;         // lru list, head is the most recently used
+};
+
+struct cand_cache {
+	struct cand_entry entries[CAND_CACHE_SIZE];
+	int buckets[CAND_BUCKETS];
+	int head, tail;
+	int count;
+	uint64_t seed;  // font description hash, so a font change misses
+	size_t tile_bytes;
+};
+
+static uint64_t cand_hash(uint64_t seed, const char *key, size_t len) {
+	uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)key[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static void lru_unlink(struct cand_cache *cache, int idx) {
+	struct cand_entry *e = &cache->entries[idx];
+	if (e->prev != -1)
+		cache->entries[e->prev].next = e->next;
+	else
+		cache->head = e->next;
+	if (e->next != -1)
+		cache->entries[e->next].prev = e->prev;
+	else
+		cache->tail = e->prev;
+}
+
+static void lru_push_front(struct cand_cache *cache, int idx) {
+	struct cand_entry *e = &cache->entries[idx];
+	e->prev = -1;
+	e->next = cache->head;
+	if (cache->head != -1)
+		cache->entries[cache->head].prev = idx;
+	cache->head = idx;
+	if (cache->tail == -1)
+		cache->tail = idx;
+}
+
+static void bucket_remove(struct cand_cache *cache, int idx) {
+	int *link = &cache->buckets[cache->entries[idx].hash % CAND_BUCKETS];
+	while (*link != idx)
+		link = &cache->entries[*link].chain;
+	*link = cache->entries[idx].chain;
+}
+
+static size_t tile_size(cairo_surface_t *tile) {
+	return (size_t)cairo_image_surface_get_stride(tile) *
+				 cairo_image_surface_get_height(tile);
+}
+
+static void tile_drop(struct cand_cache *cache, cairo_surface_t **tile) {
+	if (*tile == NULL)
+		return;
+	cache->tile_bytes -= tile_size(*tile);
+	cairo_surface_destroy(*tile);
+	*tile = NULL;
+}
+
+static void entry_drop_tile(struct cand_cache *cache, struct cand_entry *e) {
+	tile_drop(cache, &e->tile);
+	tile_drop(cache, &e->clear_tile);
+}
+
+static struct cand_entry *cand_cache_find(struct cand_cache *cache,
+																					const char *key,
+																					bool touch) {
+	size_t len = strlen(key);
+	if (len >= CAND_KEY_MAX)
+		return NULL;
+
+	uint64_t hash = cand_hash(cache->seed, key, len);
+	for (int idx = cache->buckets[hash % CAND_BUCKETS]; idx != -1;
+			 idx = cache->entries[idx].chain) {
+		struct cand_entry *e = &cache->entries[idx];
+		if (e->hash != hash || e->len != (int)len || memcmp(e->key, key, len))
+			continue;
+
+		if (touch && cache->head != idx) {
+			lru_unlink(cache, idx);
+			lru_push_front(cache, idx);
+		}
+		return e;
+	}
+	return NULL;
+}
+
+struct cand_cache *cand_cache_new() {
+	struct cand_cache *cache = calloc(1, sizeof(struct cand_cache));
+	if (cache == NULL)
+		return NULL;
+	cand_cache_clear(cache, 0);
+	return cache;
+}
+
+void cand_cache_free(struct cand_cache *cache) {
+	cand_cache_clear(cache, 0);
+	free(cache);
+}
+
+void cand_cache_clear(struct cand_cache *cache, uint64_t seed) {
+	for (int i = 0; i < cache->count; i++)
+		entry_drop_tile(cache, &cache->entries[i]);
+	for (int i = 0; i < CAND_BUCKETS; i++)
+		cache->buckets[i] = -1;
+	cache->head = -1;
+	cache->tail = -1;
+	cache->count = 0;
+	cache->seed = seed;
+}
+
+bool cand_cache_get(struct cand_cache *cache,
+										const char *key,
+										PangoRectangle *rect) {
+	struct cand_entry *e = cand_cache_find(cache, key, true);
+	if (e == NULL)
+		return false;
+	*rect = e->rect;
+	return true;
+}
+
+void cand_cache_put(struct cand_cache *cache,
+										const char *key,
+										const PangoRectangle *rect) {
+	size_t len = strlen(key);
+	if (len >= CAND_KEY_MAX)
+		return;
+
+	// Take a free slot, or recycle the least recently used one
+	int idx;
+	if (cache->count < CAND_CACHE_SIZE) {
+		idx = cache->count++;
+	} else {
+		idx = cache->tail;
+		lru_unlink(cache, idx);
+		bucket_remove(cache, idx);
+		entry_drop_tile(cache, &cache->entries[idx]);
+	}
+
+	struct cand_entry *e = &cache->entries[idx];
+	e->hash = cand_hash(cache->seed, key, len);
+	e->len = len;
+	memcpy(e->key, key, len);
+	e->rect = *rect;
+	e->tile = NULL;
+	e->clear_tile = NULL;
+
+	int *bucket = &cache->buckets[e->hash % CAND_BUCKETS];
+	e->chain = *bucket;
+	*bucket = idx;
+	lru_push_front(cache, idx);
+}
+
+cairo_surface_t *cand_cache_get_tile(struct cand_cache *cache,
+																		 const char *key,
+																		 bool clear) {
+	struct cand_entry *e = cand_cache_find(cache, key, false);
+	if (e == NULL)
+		return NULL;
+	return clear ? e->clear_tile : e->tile;
+}
+
+bool cand_cache_put_tile(struct cand_cache *cache,
+												 const char *key,
+												 bool clear,
+												 cairo_surface_t *tile) {
+	struct cand_entry *e = cand_cache_find(cache, key, false);
+	if (e == NULL)
+		return false;
+
+	cairo_surface_t **slot = clear ? &e->clear_tile : &e->tile;
+	tile_drop(cache, slot);
+	*slot = tile;
+	cache->tile_bytes += tile_size(tile);
+
+	// Over budget, keep the measurements but drop the least recently used
+	// tiles
+	for (int idx = cache->tail;
+			 idx != -1 && cache->tile_bytes > CAND_TILE_BUDGET;
+			 idx = cache->entries[idx].prev) {
+		if (&cache->entries[idx] != e)
+			entry_drop_tile(cache, &cache->entries[idx]);
+	}
+	return true;
+}
+
+#endif /* ENABLE_POPUP */
@@ -0,0 +1,147 @@
+#ifdef ENABLE_POPUP
+
+#include <string.h>
+
+/* 32-bit x86 has SSE2 only when the build targets it */
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define FILL_X86 1
+#endif
+
+#include "wlpinyin.h"
+
+#define CORNER_SAMPLES 4  // per axis, for the rounded corner coverage
+
+uint32_t fill_pixel(double r, double g, double b, double a) {
+	/* Premultiplied ARGB8888, as cairo and wl_shm expect */
+	uint32_t ia = (uint32_t)(a * 255.0 + 0.5);
+	uint32_t ir = (uint32_t)(r * a * 255.0 + 0.5);
+	uint32_t ig = (uint32_t)(g * a * 255.0 + 0.5);
+	uint32_t ib = (uint32_t)(b * a * 255.0 + 0.5);
+	return ia << 24 | ir << 16 | ig << 8 | ib;
+}
+
+static void fill_row_scalar(uint32_t *row, int width, uint32_t pixel) {
+	for (int i = 0; i < width; i++)
+		row[i] = pixel;
+}
+
+#ifdef FILL_X86
+static void fill_row_sse2(uint32_t *row, int width, uint32_t pixel) {
+	__m128i v = _mm_set1_epi32((int)pixel);
+	int i = 0;
+	for (; i + 4 <= width; i += 4)
+		_mm_storeu_si128((__m128i *)&row[i], v);
+	fill_row_scalar(&row[i], width - i, pixel);
+}
+
+__attribute__((target("avx2"))) static void fill_row_avx2(uint32_t *row,
+																												 int width,
+																												 uint32_t pixel) {
+	__m256i v = _mm256_set1_epi32((int)pixel);
+	int i = 0;
+	for (; i + 8 <= width; i += 8)
+		_mm256_storeu_si256((__m256i *)&row[i], v);
+	fill_row_scalar(&row[i], width - i, pixel);
+}
+#endif
+
+void fill_rect(void *data,
+							 int stride,
+							 int x,
+							 int y,
+							 int width,
+							 int height,
+							 uint32_t pixel) {
+	void (*fill_row)(uint32_t *, int, uint32_t) = fill_row_scalar;
+#ifdef FILL_X86
+	fill_row = __builtin_cpu_supports("avx2") ? fill_row_avx2 : fill_row_sse2;
+#endif
+
+	for (int row = 0; row < height; row++)
+		fill_row((uint32_t *)((char *)data + (y + row) * stride) + x, width,
+						 pixel);
+}
+
+static uint32_t fill_scale(uint32_t pixel, int coverage, int samples) {
+	uint32_t out = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		uint32_t c = (pixel >> shift) & 0xff;
+		out |= (c * coverage + samples / 2) / samples << shift;
+	}
+	return out;
+}
+
+static int corner_coverage(int px, int py, int radius) {
+	/* Samples of pixel (px, py) inside the arc centered at (radius, radius) */
+	int inside = 0;
+	for (int j = 0; j < CORNER_SAMPLES; j++) {
+		for (int i = 0; i < CORNER_SAMPLES; i++) {
+			double sx = px + (i + 0.5) / CORNER_SAMPLES - radius;
+			double sy = py + (j + 0.5) / CORNER_SAMPLES - radius;
+			if (sx * sx + sy * sy <= (double)radius * radius)
+				inside++;
+		}
+	}
+	return inside;
+}
+
+void fill_round_corners(void *data,
+												int stride,
+												int width,
+												int height,
+												int radius,
+												int x,
+												int y,
+												int w,
+												int h) {
+	/*
+	 * Fade the corner pixels of a width x height panel that fall in the
+	 * x, y, w, h region, so a cell repaint keeps the rounded outline.
+	 */
+	const int samples = CORNER_SAMPLES * CORNER_SAMPLES;
+	for (int cy = 0; cy < radius; cy++) {
+		for (int cx = 0; cx < radius; cx++) {
+			int coverage = corner_coverage(cx, cy, radius);
+			if (coverage == samples)
+				continue;
+
+			int xs[2] = {cx, width - 1 - cx};
+			int ys[2] = {cy, height - 1 - cy};
+			for (int k = 0; k < 4; k++) {
+				int px = xs[k & 1], py = ys[k >> 1];
+				if (px < x || px >= x + w || py < y || py >= y + h)
+					continue;
+				uint32_t *pixel = (uint32_t *)((char *)data + py * stride) + px;
+				*pixel = fill_scale(*pixel, coverage, samples);
+			}
+		}
+	}
+}
+
+void fill_blit(void *dst,
+							 int dst_stride,
+							 int dst_width,
+							 int dst_height,
+							 const void *src,
+							 int src_stride,
+							 int src_width,
+							 int src_height,
+							 int dst_x,
+							 int dst_y) {
+	/* Clamp to the destination, rows are copied by the vectorized memcpy */
+	int src_x = MAX(0, -dst_x);
+	int src_y = MAX(0, -dst_y);
+	int width = MIN(src_width, dst_width - dst_x) - src_x;
+	int height = MIN(src_height, dst_height - dst_y) - src_y;
+	if (width <= 0 || height <= 0)
+		return;
+
+	for (int row = 0; row < height; row++)
+		memcpy((char *)dst + (dst_y + src_y + row) * dst_stride +
+							 (dst_x + src_x) * 4,
+					 (const char *)src + (src_y + row) * src_stride + src_x * 4,
+					 width * 4);
+}
+
+#endif /* ENABLE_POPUP */
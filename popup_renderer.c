@@ -4,7 +4,10 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <pango/pango-fontmap.h>
@@ -19,25 +22,15 @@
 #define MAX_BACK_ROWS 2
 #define MAX_FWD_ROWS 5
 
-static int DEFAULT_SHM_SIZE = 4096;
+#define BACKGROUND_COLOR 0.25, 0.25, 0.27, 0.95
+// under the grid, the former translucent blue as it looked over the background
+#define HIGHLIGHT_COLOR 0.28, 0.39, 0.57, 0.98
+#define TEXT_COLOR 0.95, 0.95, 0.95, 1.0
 
-static void draw_rounded_rectangle(cairo_t *cr,
-																	 double x,
-																	 double y,
-																	 double width,
-																	 double height,
-																	 double radius) {
-	cairo_move_to(cr, x + radius, y);
-	cairo_line_to(cr, x + width - radius, y);
-	cairo_curve_to(cr, x + width, y, x + width, y, x + width, y + radius);
-	cairo_line_to(cr, x + width, y + height - radius);
-	cairo_curve_to(cr, x + width, y + height, x + width, y + height,
-								 x + width - radius, y + height);
-	cairo_line_to(cr, x + radius, y + height);
-	cairo_curve_to(cr, x, y + height, x, y + height, x, y + height - radius);
-	cairo_line_to(cr, x, y + radius);
-	cairo_curve_to(cr, x, y, x, y, x + radius, y);
-}
+#define SHRINK_DELAY_MS (10 * 1000)
+#define HIGHLIGHT_POOL_SIZE (64 * 1024)
+
+static int DEFAULT_SHM_SIZE = 4096;
 
 static void popup_handle_frame_done(void *data,
 																		struct wl_callback *cb,
@@ -48,199 +41,844 @@ static void popup_handle_frame_done(void *data,
 	struct wlpinyin_state *state = data;
 	state->frame_callback_done = true;
 	if (state->pending_render)
-		im_panel_update(state);
+		loop_idle_schedule(state, &state->render_idle);
 }
 
-int im_panel_update(struct wlpinyin_state *state) {
-	char buf[256];
-	int bufptr = 0;
+static void popup_pool_destroy(struct wlpinyin_state *state) {
+	for (int i = 0; i < POPUP_BUFFERS; i++) {
+		struct popup_buffer *b = &state->popup_buffers[i];
+		if (b->buffer)
+			wl_buffer_destroy(b->buffer);
+		*b = (struct popup_buffer){0};
+	}
+	if (state->popup_data) {
+		munmap(state->popup_data, state->shm_size);
+		state->popup_data = NULL;
+	}
+	if (state->shm_pool) {
+		wl_shm_pool_destroy(state->shm_pool);
+		state->shm_pool = NULL;
+	}
+	if (state->shm_pool_fd >= 0) {
+		close(state->shm_pool_fd);
+		state->shm_pool_fd = -1;
+	}
+	state->shm_size = 0;
+	state->shm_slot_size = 0;
+	state->popup_front = -1;
+}
+
+static void popup_retired_destroy(struct wlpinyin_state *state) {
+	for (int i = 0; i < state->nretired; i++)
+		wl_buffer_destroy(state->retired_buffers[i]);
+	state->nretired = 0;
+	if (state->retired_data) {
+		munmap(state->retired_data, state->retired_size);
+		state->retired_data = NULL;
+	}
+	if (state->retired_pool) {
+		wl_shm_pool_destroy(state->retired_pool);
+		state->retired_pool = NULL;
+	}
+	if (state->retired_pool_fd >= 0) {
+		close(state->retired_pool_fd);
+		state->retired_pool_fd = -1;
+	}
+	state->retired_size = 0;
+}
+
+/*
+ * Set the pool aside for a bigger one. The buffers the compositor holds keep
+ * it mapped until they are released, the idle ones go now.
+ */
+static void popup_pool_retire(struct wlpinyin_state *state) {
+	for (int i = 0; i < POPUP_BUFFERS; i++) {
+		struct popup_buffer *b = &state->popup_buffers[i];
+		if (b->busy)
+			state->retired_buffers[state->nretired++] = b->buffer;
+		else if (b->buffer)
+			wl_buffer_destroy(b->buffer);
+		*b = (struct popup_buffer){0};
+	}
+	state->retired_pool_fd = state->shm_pool_fd;
+	state->retired_pool = state->shm_pool;
+	state->retired_data = state->popup_data;
+	state->retired_size = state->shm_size;
+	state->shm_pool_fd = -1;
+	state->shm_pool = NULL;
+	state->popup_data = NULL;
+	state->shm_size = 0;
+	state->shm_slot_size = 0;
+	state->popup_front = -1;
+	if (state->nretired == 0)
+		popup_retired_destroy(state);
+}
+
+static int popup_shm_create(int size, void **data) {
+	int fd = memfd_create("wlpinyin", MFD_CLOEXEC);
+	if (fd < 0) {
+		wlpinyin_err("fail to create shm: %s", strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		wlpinyin_err("fail to resize shm: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	*data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*data == MAP_FAILED) {
+		wlpinyin_err("mmap failed: %s", strerror(errno));
+		*data = NULL;
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int popup_pool_create(struct wlpinyin_state *state, int slot_size) {
+	/*
+	 * Resizing always starts a new memfd, truncating the old one could pull
+	 * pages from under a buffer the compositor still reads.
+	 */
+	slot_size = (slot_size + DEFAULT_SHM_SIZE - 1) / DEFAULT_SHM_SIZE *
+							DEFAULT_SHM_SIZE;
+	int size = slot_size * POPUP_BUFFERS;
+
+	state->shm_pool_fd = popup_shm_create(size, &state->popup_data);
+	if (state->shm_pool_fd < 0)
+		return -1;
+
+	state->shm_pool = wl_shm_create_pool(state->wl_shm, state->shm_pool_fd, size);
+	state->shm_size = size;
+	state->shm_slot_size = slot_size;
+	return 0;
+}
+
+static void popup_handle_buffer_release(void *data, struct wl_buffer *buffer) {
+	struct wlpinyin_state *state = data;
+	pthread_mutex_lock(&state->render_lock);
+	for (int i = 0; i < POPUP_BUFFERS; i++) {
+		if (state->popup_buffers[i].buffer == buffer)
+			state->popup_buffers[i].busy = false;
+	}
+	for (int i = 0; i < state->nretired; i++) {
+		if (state->retired_buffers[i] != buffer)
+			continue;
+		wl_buffer_destroy(buffer);
+		state->retired_buffers[i] = state->retired_buffers[--state->nretired];
+		if (state->nretired == 0)
+			popup_retired_destroy(state);
+		break;
+	}
+	pthread_mutex_unlock(&state->render_lock);
 
+	/* A frame may be waiting for a free slot */
+	if (state->pending_render && state->frame_callback_done)
+		loop_idle_schedule(state, &state->render_idle);
+}
+
+static struct popup_buffer *popup_buffer_get(struct wlpinyin_state *state,
+																						 int width,
+																						 int height,
+																						 int stride) {
+	struct popup_buffer *slot = NULL;
+	pthread_mutex_lock(&state->render_lock);
+	if (stride * height > state->shm_slot_size) {
+		/* Still waiting on an older pool, a release reschedules us */
+		if (state->nretired > 0)
+			goto out;
+		popup_pool_retire(state);
+		if (popup_pool_create(state, stride * height) != 0)
+			goto out;
+	}
+
+	/* Reuse an idle buffer of the same size, else recreate an idle slot */
+	for (int i = 0; i < POPUP_BUFFERS; i++) {
+		struct popup_buffer *b = &state->popup_buffers[i];
+		if (b->busy)
+			continue;
+		if (b->buffer && b->width == width && b->height == height &&
+				b->stride == stride) {
+			slot = b;
+			break;
+		}
+		if (slot == NULL)
+			slot = b;
+	}
+	if (slot == NULL)
+		goto out;
+
+	if (slot->width != width || slot->height != height ||
+			slot->stride != stride || slot->buffer == NULL) {
+		static const struct wl_buffer_listener buffer_listener = {
+				.release = popup_handle_buffer_release,
+		};
+
+		if (slot->buffer)
+			wl_buffer_destroy(slot->buffer);
+		int offset = (slot - state->popup_buffers) * state->shm_slot_size;
+		slot->buffer =
+				wl_shm_pool_create_buffer(state->shm_pool, offset, width, height,
+																	stride, WL_SHM_FORMAT_ARGB8888);
+		wl_buffer_add_listener(slot->buffer, &buffer_listener, state);
+		slot->width = width;
+		slot->height = height;
+		slot->stride = stride;
+		slot->layout = 0;
+	}
+
+	/* Ours until the main thread hands it to the compositor or drops it */
+	slot->busy = true;
+
+out:
+	pthread_mutex_unlock(&state->render_lock);
+	return slot;
+}
+
+static void highlight_pool_destroy(struct wlpinyin_state *state) {
+	/* The buffers never change, so destroying the one on screen is fine */
+	for (int i = 0; i < state->nhighlights; i++)
+		wl_buffer_destroy(state->highlights[i].buffer);
+	state->nhighlights = 0;
+	state->highlight_shown = NULL;
+	if (state->highlight_data) {
+		munmap(state->highlight_data, state->highlight_pool_size);
+		state->highlight_data = NULL;
+	}
+	if (state->highlight_pool) {
+		wl_shm_pool_destroy(state->highlight_pool);
+		state->highlight_pool = NULL;
+	}
+	if (state->highlight_pool_fd >= 0) {
+		close(state->highlight_pool_fd);
+		state->highlight_pool_fd = -1;
+	}
+	state->highlight_pool_size = 0;
+	state->highlight_pool_used = 0;
+}
+
+static struct popup_highlight *highlight_get(struct wlpinyin_state *state,
+																						 int width,
+																						 int height) {
+	for (int i = 0; i < state->nhighlights; i++) {
+		struct popup_highlight *hl = &state->highlights[i];
+		if (hl->width == width && hl->height == height)
+			return hl;
+	}
+
+	/* Full, start over in a fresh memfd */
+	int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+	int size = stride * height;
+	if (state->nhighlights == POPUP_HIGHLIGHTS ||
+			state->highlight_pool_used + size > state->highlight_pool_size) {
+		highlight_pool_destroy(state);
+		int pool_size = MAX(HIGHLIGHT_POOL_SIZE, size);
+		state->highlight_pool_fd =
+				popup_shm_create(pool_size, &state->highlight_data);
+		if (state->highlight_pool_fd < 0)
+			return NULL;
+		state->highlight_pool = wl_shm_create_pool(
+				state->wl_shm, state->highlight_pool_fd, pool_size);
+		state->highlight_pool_size = pool_size;
+	}
+
+	int offset = state->highlight_pool_used;
+	fill_rect((char *)state->highlight_data + offset, stride, 0, 0, width,
+						height, fill_pixel(HIGHLIGHT_COLOR));
+
+	struct popup_highlight *hl = &state->highlights[state->nhighlights++];
+	hl->buffer =
+			wl_shm_pool_create_buffer(state->highlight_pool, offset, width, height,
+																stride, WL_SHM_FORMAT_ARGB8888);
+	hl->width = width;
+	hl->height = height;
+	state->highlight_pool_used += size;
+	return hl;
+}
+
+static void popup_handle_shrink(struct wlpinyin_state *state,
+																uint64_t expirations,
+																void *data) {
+	UNUSED(expirations);
+	UNUSED(data);
+	if (state->popup_shown || state->shm_slot_size <= DEFAULT_SHM_SIZE)
+		return;
+
+	/* Hidden for a while, give back a pool grown by a long candidate list */
+	bool busy = state->render_busy;
+	pthread_mutex_lock(&state->render_lock);
+	for (int i = 0; i < POPUP_BUFFERS; i++)
+		busy = busy || state->popup_buffers[i].busy;
+	if (!busy) {
+		popup_pool_destroy(state);
+		popup_pool_create(state, DEFAULT_SHM_SIZE);
+	}
+	pthread_mutex_unlock(&state->render_lock);
+
+	if (busy)
+		loop_timer_arm(&state->popup_shrink_timer, SHRINK_DELAY_MS, 0);
+}
+
+static void popup_render(struct wlpinyin_state *state, void *data);
+
+static void popup_measure(struct wlpinyin_state *state,
+													char **texts,
+													PangoRectangle *rects,
+													int n) {
+	struct arena *arena = &state->render_arena;
+	const char **misses = arena_alloc(arena, MAX(1, n) * sizeof(char *));
+	int *miss_idx = arena_alloc(arena, MAX(1, n) * sizeof(int));
+	PangoRectangle *miss_rects =
+			arena_alloc(arena, MAX(1, n) * sizeof(PangoRectangle));
+	if (misses == NULL || miss_idx == NULL || miss_rects == NULL)
+		return;
+
+	int nmisses = 0;
+	for (int i = 0; i < n; i++) {
+		if (cand_cache_get(state->cand_cache, texts[i], &rects[i])) {
+			state->render_frame.measure_hits++;
+			continue;
+		}
+		misses[nmisses] = texts[i];
+		miss_idx[nmisses] = i;
+		nmisses++;
+	}
+
+	/* Shape whatever the cache lacks in one batch across the workers */
+	shaper_measure(state->shaper, state->popup_pango_layout, misses, miss_rects,
+								 nmisses);
+	for (int i = 0; i < nmisses; i++) {
+		rects[miss_idx[i]] = miss_rects[i];
+		cand_cache_put(state->cand_cache, misses[i], &miss_rects[i]);
+	}
+	state->render_frame.measure_misses += nmisses;
+}
+
+static uint64_t popup_now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t popup_hash(uint64_t hash, const void *data, size_t len) {
+	const unsigned char *bytes = data;
+	if (hash == 0)
+		hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static void popup_damage(struct wl_surface *surface,
+												 int x,
+												 int y,
+												 int width,
+												 int height) {
+	/* The popup is never scaled, buffer and surface coordinates agree */
+	if (wl_surface_get_version(surface) >= WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION)
+		wl_surface_damage_buffer(surface, x, y, width, height);
+	else
+		wl_surface_damage(surface, x, y, width, height);
+}
+
+static cairo_surface_t *popup_tile(struct wlpinyin_state *state,
+																	 const char *text,
+																	 const PangoRectangle *rect,
+																	 bool clear,
+																	 bool *owned) {
+	*owned = false;
+	cairo_surface_t *tile = cand_cache_get_tile(state->cand_cache, text, clear);
+	if (tile)
+		return tile;
+
+	/*
+	 * Rasterize the text over the background so blitting it is a plain copy.
+	 * The highlighted cell shows the highlight below through a clear tile.
+	 */
+	tile = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, MAX(1, rect->width),
+																		MAX(1, rect->height));
+	if (!clear) {
+		cairo_surface_flush(tile);
+		fill_rect(cairo_image_surface_get_data(tile),
+							cairo_image_surface_get_stride(tile), 0, 0,
+							cairo_image_surface_get_width(tile),
+							cairo_image_surface_get_height(tile),
+							fill_pixel(BACKGROUND_COLOR));
+		cairo_surface_mark_dirty(tile);
+	}
+
+	cairo_t *cr = cairo_create(tile);
+	cairo_set_source_rgba(cr, TEXT_COLOR);
+	cairo_move_to(cr, -rect->x, -rect->y);
+	pango_layout_set_text(state->popup_pango_layout, text, -1);
+	pango_cairo_show_layout(cr, state->popup_pango_layout);
+	cairo_destroy(cr);
+	cairo_surface_flush(tile);
+
+	/* Too long to be cached, the caller frees it after use */
+	*owned = !cand_cache_put_tile(state->cand_cache, text, clear, tile);
+	return tile;
+}
+
+static void popup_draw(struct wlpinyin_state *state,
+											 struct popup_buffer *buffer,
+											 const uint64_t *cells,
+											 char **texts,
+											 int ncells,
+											 int ncands,
+											 int highlighted,
+											 int page_size,
+											 const int *row_width,
+											 const int *col_x,
+											 int row_height,
+											 uint64_t layout) {
+	/* Repaint what differs from the frame this slot last held */
+	bool full_repaint = ncells > POPUP_MAX_CELLS || buffer->layout != layout;
+	int slot = buffer - state->popup_buffers;
+	char *data = (char *)state->popup_data + slot * state->shm_slot_size;
+	uint32_t background = fill_pixel(BACKGROUND_COLOR);
+
+	/*
+	 * Cell backgrounds, faded at the rounded panel corners. The highlighted
+	 * cell stays clear, the highlight subsurface below shows through it.
+	 */
+	for (int i = 0; i < ncells; i++) {
+		if (!full_repaint && buffer->cells[i] == cells[i])
+			continue;
+		int col = i % page_size;
+		int x = col_x[col];
+		int y = (i / page_size) * row_height;
+
+		fill_rect(data, buffer->stride, x, y, row_width[col], row_height,
+							i == highlighted ? 0 : background);
+		fill_round_corners(data, buffer->stride, buffer->width, buffer->height,
+											 CORNER_RADIUS, x, y, row_width[col], row_height);
+	}
+
+	/* Copy cached candidate tiles into the repainted cells */
+	struct arena *arena = &state->render_arena;
+	char **dirty = arena_alloc(arena, MAX(1, ncands) * sizeof(char *));
+	int *dirty_idx = arena_alloc(arena, MAX(1, ncands) * sizeof(int));
+	PangoRectangle *rects =
+			arena_alloc(arena, MAX(1, ncands) * sizeof(PangoRectangle));
+	int ndirty = 0;
+	for (int i = 0; i < ncands && dirty && dirty_idx && rects; i++) {
+		if (!full_repaint && buffer->cells[i] == cells[i])
+			continue;
+		dirty[ndirty] = texts[i];
+		dirty_idx[ndirty] = i;
+		ndirty++;
+	}
+	popup_measure(state, dirty, rects, ndirty);
+
+	for (int j = 0; j < ndirty; j++) {
+		int i = dirty_idx[j];
+		int col = i % page_size;
+		int x = col_x[col];
+		int y = (i / page_size) * row_height;
+
+		bool owned;
+		cairo_surface_t *tile =
+				popup_tile(state, dirty[j], &rects[j], i == highlighted, &owned);
+		fill_blit(data, buffer->stride, buffer->width, buffer->height,
+							cairo_image_surface_get_data(tile),
+							cairo_image_surface_get_stride(tile),
+							cairo_image_surface_get_width(tile),
+							cairo_image_surface_get_height(tile),
+							x + ITEM_SPACING + rects[j].x, y + ROW_SPACING + rects[j].y);
+		if (owned)
+			cairo_surface_destroy(tile);
+	}
+}
+
+int im_panel_update(struct wlpinyin_state *state) {
 	im_preedit_t preedit = im_engine_preedit(state->engine);
-	zwp_input_method_v2_set_preedit_string(state->input_method, preedit.text,
-																				 preedit.begin, preedit.end);
+	im_set_preedit(state, preedit.text, preedit.begin, preedit.end);
 
-	im_context_t ctx = im_engine_context(state->engine);
+	const im_snapshot_t *snap = im_engine_snapshot(state->engine, 0, 0);
 
 	/* Empty, show nothing */
-	if (ctx.page_size == 0) {
-		wl_surface_attach(state->popup_surface, NULL, 0, 0);
-		wl_surface_commit(state->popup_surface);
+	if (snap->page_size == 0) {
+		loop_idle_cancel(state, &state->render_idle);
+		if (state->popup_shown) {
+			wl_surface_attach(state->popup_surface, NULL, 0, 0);
+			wl_surface_commit(state->popup_surface);
+		} else {
+			state->stats.suppressed_hides++;
+		}
 		state->frame_callback_done = true;
 		state->pending_render = false;
+		state->render_discard = state->render_busy;
+		pthread_mutex_lock(&state->render_lock);
+		state->popup_front = -1;
+		pthread_mutex_unlock(&state->render_lock);
+		if (state->popup_shown) {
+			state->popup_shown = false;
+			loop_timer_arm(&state->popup_shrink_timer, SHRINK_DELAY_MS, 0);
+		}
 		return 0;
 	}
 
-	/* If not ready, just return */
-	if (!state->frame_callback_done) {
-		state->pending_render = true;
-		return 0;
-	}
-
-	/* Setup new frame callback */
-	state->frame_callback_done = false;
-	struct wl_callback *cb = wl_surface_frame(state->popup_surface);
-	static const struct wl_callback_listener frame_listener = {
-			.done = popup_handle_frame_done,
-	};
-	wl_callback_add_listener(cb, &frame_listener, state);
+	/* Rasterize once the pending keys are handled and the compositor is ready */
+	state->pending_render = true;
+	if (state->frame_callback_done)
+		loop_idle_schedule(state, &state->render_idle);
+	return 0;
+}
 
-	int start_row, end_row;
-	if (ctx.page_no == 0) {
-		start_row = 0;
-		end_row = 1;
-	} else {
-		start_row = MAX(0, ctx.page_no - MAX_BACK_ROWS);
-		end_row = start_row + MAX_FWD_ROWS;
-	}
+/*
+ * Render thread side. Measures and rasterizes the posted job into a free pool
+ * slot and describes the result in render_frame, the main thread presents it.
+ */
+static void popup_render_job(struct wlpinyin_state *state) {
+	struct popup_job *job = &state->render_job;
+	struct popup_frame *frame = &state->render_frame;
+	struct arena *arena = &state->render_arena;
+	int page_size = job->page_size;
+	int ncands = job->ncands;
 
-	int start_idx = start_row * ctx.page_size;
+	arena_reset(arena);
+	frame->slot = -1;
+	frame->no_buffer = false;
+	frame->page_size = page_size;
+	frame->highlighted = -1;
+	frame->measure_hits = 0;
+	frame->measure_misses = 0;
+	frame->draw_us = 0;
 
 	/* Measure column widths */
-	int row_width[50] = {0};
+	int *row_width = frame->row_width;
 	int row_height = 0;
+	for (int i = 0; i < page_size; i++)
+		row_width[i] = 0;
 
-	int real_end_row = 0;
-	im_engine_cand_begin(state->engine, start_idx);
-	int i;
-	for (i = start_idx; im_engine_cand_next(state->engine); i++) {
-		int row = i / ctx.page_size;
-		int col = i % ctx.page_size;
-		if (row >= end_row) {
-			i--;
-			break;
-		}
+	char **measure = arena_alloc(arena, MAX(1, ncands) * sizeof(char *));
+	PangoRectangle *rects =
+			arena_alloc(arena, MAX(1, ncands) * sizeof(PangoRectangle));
+	if (measure == NULL || rects == NULL)
+		return;
+	for (int i = 0; i < ncands; i++)
+		measure[i] = arena_printf(arena, "%s %s", job->labels[i % page_size],
+															job->texts[i]);
+	popup_measure(state, measure, rects, ncands);
 
-		const char *text = im_engine_cand_get(state->engine);
-		bufptr =
-				snprintf(&buf[bufptr], sizeof(buf) - bufptr, "%d %s", col + 1, text);
-		pango_layout_set_text(state->popup_pango_layout, buf, bufptr);
-		PangoRectangle text_rect;
-		pango_layout_get_pixel_extents(state->popup_pango_layout, NULL, &text_rect);
-
-		int item_width = text_rect.width + ITEM_SPACING * 2;
+	for (int i = 0; i < ncands; i++) {
+		int col = i % page_size;
+		int item_width = rects[i].width + ITEM_SPACING * 2;
 		row_width[col] = MAX(row_width[col], item_width);
-		row_height = MAX(row_height, text_rect.height + ROW_SPACING * 2);
+		row_height = MAX(row_height, rects[i].height + ROW_SPACING * 2);
 	}
-	int row = i / ctx.page_size;
-	int col = i % ctx.page_size;
-	if (col == 0 && !im_engine_cand_next(state->engine))
-		real_end_row = row;
-	else
-		real_end_row = row + 1;
-	im_engine_cand_end(state->engine);
+	frame->row_height = row_height;
 
 	/* Calculate panel size */
 	int panel_width = 0;
-	for (int i = 0; i < ctx.page_size; i++)
+	for (int i = 0; i < page_size; i++) {
+		frame->col_x[i] = panel_width;
 		panel_width += row_width[i];
-	int panel_height = row_height * MAX(1, real_end_row - start_row);
+	}
+	int nrows = MAX(1, (ncands + page_size - 1) / page_size);
+	int panel_height = row_height * nrows;
+
+	int ncells = nrows * page_size;
+	frame->ncells = ncells;
+	int highlighted =
+			(job->page_no - job->start_row) * page_size + job->highlighted_index;
+	if (job->page_no >= job->start_row && job->highlighted_index < page_size &&
+			highlighted < ncands)
+		frame->highlighted = highlighted;
+
+	/* Key every cell of the new grid, empty cells are 0 */
+	uint64_t layout = popup_hash(0, &panel_width, sizeof(panel_width));
+	layout = popup_hash(layout, &panel_height, sizeof(panel_height));
+	layout = popup_hash(layout, row_width, page_size * sizeof(row_width[0]));
+
+	uint64_t *cells = arena_alloc(arena, ncells * sizeof(uint64_t));
+	char **texts = arena_alloc(arena, ncells * sizeof(char *));
+	if (cells == NULL || texts == NULL)
+		return;
+	for (int i = 0; i < ncells; i++) {
+		cells[i] = 0;
+		texts[i] = NULL;
+		if (i >= ncands)
+			continue;
+
+		char *buf = arena_printf(arena, "%s ", job->labels[i % page_size]);
+		if (job->start_row + i / page_size != job->page_no)
+			memset(buf, ' ', strlen(buf));
+		buf = arena_append(arena, buf, "%s", job->texts[i]);
+		cells[i] = popup_hash(layout, buf, strlen(buf));
+		if (i == frame->highlighted)
+			cells[i] = popup_hash(cells[i], &i, sizeof(i));
+		texts[i] = buf;
+	}
+
+	/* Damage what differs from the grid on screen */
+	bool records = ncells <= POPUP_MAX_CELLS;
+	pthread_mutex_lock(&state->render_lock);
+	int front_slot = state->popup_front;
+	pthread_mutex_unlock(&state->render_lock);
+	struct popup_buffer *front =
+			front_slot >= 0 ? &state->popup_buffers[front_slot] : NULL;
+	frame->full_damage = !records || front == NULL || front->layout != layout;
+
+	int damaged = 0;
+	for (int i = 0; i < ncells && records; i++) {
+		frame->damaged[i] = frame->full_damage || front->cells[i] != cells[i];
+		if (frame->damaged[i])
+			damaged++;
+	}
+
+	/* The grid on screen is still right, highlight included */
+	if (damaged == 0 && !frame->full_damage)
+		return;
 
-	/* Resize buffer if needed */
 	int panel_stride =
 			cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, panel_width);
-	int buffer_newsz = panel_stride * panel_height;
+	struct popup_buffer *buffer =
+			popup_buffer_get(state, panel_width, panel_height, panel_stride);
+	if (buffer == NULL) {
+		frame->no_buffer = true;
+		return;
+	}
+	uint64_t draw_start = popup_now_us();
+	popup_draw(state, buffer, cells, texts, ncells, ncands, frame->highlighted,
+						 page_size, row_width, frame->col_x, row_height, layout);
+	frame->draw_us = popup_now_us() - draw_start;
 
-	if (state->shm_size < buffer_newsz) {
-		if (state->popup_data) {
-			munmap(state->popup_data, state->shm_size);
-			state->popup_data = NULL;
-		}
+	buffer->layout = records ? layout : 0;
+	if (records)
+		memcpy(buffer->cells, cells, ncells * sizeof(uint64_t));
+	frame->slot = buffer - state->popup_buffers;
+}
 
-		if (ftruncate(state->shm_pool_fd, buffer_newsz) < 0) {
-			wlpinyin_err("fail to resize shm: %s", strerror(errno));
-			state->frame_callback_done = true;
-			return -1;
-		}
-		wl_shm_pool_resize(state->shm_pool, buffer_newsz);
-
-		state->popup_data = mmap(NULL, buffer_newsz, PROT_READ | PROT_WRITE,
-														 MAP_SHARED, state->shm_pool_fd, 0);
-		if (state->popup_data == MAP_FAILED) {
-			wlpinyin_err("mmap failed: %s", strerror(errno));
-			state->popup_data = NULL;
-			state->frame_callback_done = true;
-			return -1;
-		}
-		state->shm_size = buffer_newsz;
-	}
-
-	/* Recreate buffer */
-	if (state->shm_buffer)
-		wl_buffer_destroy(state->shm_buffer);
-	state->shm_buffer =
-			wl_shm_pool_create_buffer(state->shm_pool, 0, panel_width, panel_height,
-																panel_stride, WL_SHM_FORMAT_ARGB8888);
-
-	/* Create Cairo surface */
-	cairo_surface_t *cairo_surface = cairo_image_surface_create_for_data(
-			state->popup_data, CAIRO_FORMAT_ARGB32, panel_width, panel_height,
-			panel_stride);
-	cairo_t *cr = cairo_create(cairo_surface);
-
-	/* Clear */
-	cairo_set_source_rgba(cr, 0, 0, 0, 0);
-	cairo_paint(cr);
-
-	/* Draw background */
-	draw_rounded_rectangle(cr, 0, 0, panel_width, panel_height, CORNER_RADIUS);
-	cairo_set_source_rgba(cr, 0.25, 0.25, 0.27, 0.95);
-	cairo_fill(cr);
-
-	/* Draw candidates in grid layout */
-	im_engine_cand_begin(state->engine, start_idx);
-	for (int i = start_idx; im_engine_cand_next(state->engine); i++) {
-		const char *text = im_engine_cand_get(state->engine);
-		int row = i / ctx.page_size;
-		int col = i % ctx.page_size;
-		if (row > real_end_row)
+static void *popup_render_thread(void *data) {
+	struct wlpinyin_state *state = data;
+
+	pthread_mutex_lock(&state->render_lock);
+	for (;;) {
+		while (!state->render_posted && !state->render_quit)
+			pthread_cond_wait(&state->render_cond, &state->render_lock);
+		if (state->render_quit)
 			break;
+		state->render_posted = false;
+		pthread_mutex_unlock(&state->render_lock);
 
-		int x = 0;
-		for (int c = 0; c < col; c++)
-			x += row_width[c];
-		int y = (row - start_row) * row_height;
-
-		bufptr = 0;
-		bufptr = snprintf(&buf[bufptr], sizeof(buf) - bufptr, "%d ", col + 1);
-		if (row != ctx.page_no)
-			for (int i = 0; i < bufptr; i++)
-				buf[i] = ' ';
-		bufptr += snprintf(&buf[bufptr], sizeof(buf) - bufptr, "%s", text);
-		pango_layout_set_text(state->popup_pango_layout, buf, bufptr);
-		PangoRectangle text_rect;
-		pango_layout_get_pixel_extents(state->popup_pango_layout, NULL, &text_rect);
-
-		/* Draw highlight background */
-		if (row == ctx.page_no && col == ctx.highlighted_index) {
-			draw_rounded_rectangle(cr, x, y, row_width[col], row_height, 0);
-			cairo_set_source_rgba(cr, 0.3, 0.5, 0.8, 1.0);
-			cairo_fill(cr);
-		}
+		popup_render_job(state);
 
-		cairo_set_source_rgba(cr, 0.95, 0.95, 0.95, 1.0);
-		cairo_move_to(cr, x + ITEM_SPACING, y + ROW_SPACING);
-		pango_cairo_show_layout(cr, state->popup_pango_layout);
+		/* Signal under the lock, the main thread takes it before reading */
+		pthread_mutex_lock(&state->render_lock);
+		uint64_t one = 1;
+		if (write(state->render_fd, &one, sizeof(one)) != sizeof(one))
+			wlpinyin_err("failed to signal rendered frame: %s", strerror(errno));
 	}
-	im_engine_cand_end(state->engine);
+	pthread_mutex_unlock(&state->render_lock);
+	return NULL;
+}
 
-	cairo_destroy(cr);
-	cairo_surface_destroy(cairo_surface);
+static void popup_render(struct wlpinyin_state *state, void *data) {
+	UNUSED(data);
+	struct popup_job *job = &state->render_job;
 
-	/* Commit to wayland */
-	wl_surface_attach(state->popup_surface, state->shm_buffer, 0, 0);
-	wl_surface_damage(state->popup_surface, 0, 0, panel_width, panel_height);
-	wl_surface_commit(state->popup_surface);
+	/* The rime worker holds the engine, the key results update us again */
+	if (!key_queue_idle(state->keys)) {
+		state->panel_deferred = true;
+		return;
+	}
+
+	const im_snapshot_t *snap = im_engine_snapshot(state->engine, 0, 0);
+
+	/*
+	 * Hidden, not ready, or the thread is still busy. The frame callback or the
+	 * finished frame reschedules us, and then posts the newest snapshot.
+	 */
+	if (snap->page_size == 0 || !state->pending_render ||
+			!state->frame_callback_done || state->render_busy)
+		return;
+
+	int page_size = MIN(snap->page_size, POPUP_MAX_COLS);
+	int start_row, end_row;
+	if (snap->page_no == 0) {
+		start_row = 0;
+		end_row = 1;
+	} else {
+		start_row = MAX(0, snap->page_no - MAX_BACK_ROWS);
+		end_row = start_row + MAX_FWD_ROWS;
+	}
+
+	/* Copy what the thread needs, the snapshot changes under it otherwise */
+	int start_idx = start_row * page_size;
+	int max_cands = (end_row - start_row) * page_size;
+	snap = im_engine_snapshot(state->engine, start_idx, max_cands);
+	if (snap->first > start_idx)
+		return;
+	int offset = start_idx - snap->first;
+	int ncands = CLAMP(snap->count - offset, 0, max_cands);
+
+	arena_reset(&job->arena);
+	job->page_size = page_size;
+	job->page_no = snap->page_no;
+	job->highlighted_index = snap->highlighted_index;
+	job->start_row = start_row;
+	job->ncands = ncands;
+	job->texts = arena_alloc(&job->arena, MAX(1, ncands) * sizeof(char *));
+	job->labels = arena_alloc(&job->arena, page_size * sizeof(char *));
+	if (job->texts == NULL || job->labels == NULL)
+		return;
+	for (int i = 0; i < ncands; i++)
+		job->texts[i] = arena_strdup(&job->arena, snap->texts[offset + i]);
+	for (int i = 0; i < page_size; i++)
+		job->labels[i] = arena_strdup(&job->arena, snap->labels[i]);
+
+	pthread_mutex_lock(&state->render_lock);
+	state->render_posted = true;
+	pthread_cond_signal(&state->render_cond);
+	pthread_mutex_unlock(&state->render_lock);
+
+	state->render_busy = true;
 	state->pending_render = false;
+}
 
-	return 0;
+static void popup_present(struct wlpinyin_state *state,
+													const struct popup_frame *frame) {
+	int page_size = frame->page_size;
+
+	/*
+	 * The highlight lives in its own subsurface under the grid, moving it only
+	 * repaints the two cells it leaves and enters, from cached tiles.
+	 */
+	struct popup_highlight *hl = NULL;
+	int hl_x = 0, hl_y = 0;
+	if (frame->highlighted >= 0) {
+		int col = frame->highlighted % page_size;
+		hl = highlight_get(state, frame->row_width[col], frame->row_height);
+		hl_x = frame->col_x[col];
+		hl_y = (frame->highlighted / page_size) * frame->row_height;
+	}
+	bool highlight_changed =
+			hl != state->highlight_shown ||
+			(hl && (hl_x != state->highlight_x || hl_y != state->highlight_y));
+
+	/* Same frame as on screen, nothing to present */
+	if (frame->slot < 0 && !highlight_changed)
+		return;
+
+	if (highlight_changed) {
+		wl_surface_attach(state->highlight_surface, hl ? hl->buffer : NULL, 0, 0);
+		if (hl) {
+			popup_damage(state->highlight_surface, 0, 0, hl->width, hl->height);
+			wl_subsurface_set_position(state->highlight_subsurface, hl_x, hl_y);
+		}
+		wl_surface_commit(state->highlight_surface);
+		state->highlight_shown = hl;
+		state->highlight_x = hl_x;
+		state->highlight_y = hl_y;
+	}
+
+	/* Setup new frame callback */
+	state->frame_callback_done = false;
+	struct wl_callback *cb = wl_surface_frame(state->popup_surface);
+	static const struct wl_callback_listener frame_listener = {
+			.done = popup_handle_frame_done,
+	};
+	wl_callback_add_listener(cb, &frame_listener, state);
+
+	/*
+	 * Commit to wayland, damaging only the cells that changed on screen. The
+	 * highlight is synchronized, this commit also applies its new state.
+	 */
+	if (frame->slot >= 0) {
+		struct popup_buffer *buffer = &state->popup_buffers[frame->slot];
+		wl_surface_attach(state->popup_surface, buffer->buffer, 0, 0);
+		if (frame->full_damage) {
+			popup_damage(state->popup_surface, 0, 0, buffer->width, buffer->height);
+		} else {
+			for (int i = 0; i < frame->ncells; i++) {
+				if (!frame->damaged[i])
+					continue;
+				int col = i % page_size;
+				popup_damage(state->popup_surface, frame->col_x[col],
+										 (i / page_size) * frame->row_height,
+										 frame->row_width[col], frame->row_height);
+			}
+		}
+		pthread_mutex_lock(&state->render_lock);
+		state->popup_front = frame->slot;
+		pthread_mutex_unlock(&state->render_lock);
+	}
+	wl_surface_commit(state->popup_surface);
+	state->popup_shown = true;
+}
+
+static void popup_handle_rendered(struct wlpinyin_state *state,
+																	uint32_t events,
+																	void *data) {
+	UNUSED(events);
+	UNUSED(data);
+	uint64_t count;
+	if (read(state->render_fd, &count, sizeof(count)) != sizeof(count))
+		return;
+
+	pthread_mutex_lock(&state->render_lock);
+	pthread_mutex_unlock(&state->render_lock);
+
+	struct popup_frame *frame = &state->render_frame;
+	state->render_busy = false;
+	state->stats.measure_hits += frame->measure_hits;
+	state->stats.measure_misses += frame->measure_misses;
+	if (frame->slot >= 0) {
+		state->stats.frames++;
+		state->stats.draw_us_sum += frame->draw_us;
+		if (frame->draw_us > state->stats.draw_us_max)
+			state->stats.draw_us_max = frame->draw_us;
+	}
+
+	if (state->render_discard) {
+		/* Hidden meanwhile, the slot never reached the compositor */
+		state->render_discard = false;
+		if (frame->slot >= 0) {
+			pthread_mutex_lock(&state->render_lock);
+			state->popup_buffers[frame->slot].busy = false;
+			pthread_mutex_unlock(&state->render_lock);
+		}
+	} else if (frame->no_buffer) {
+		/* Every slot is with the compositor, a release reschedules us */
+		state->pending_render = true;
+		return;
+	} else {
+		popup_present(state, frame);
+	}
+
+	if (state->pending_render && state->frame_callback_done)
+		loop_idle_schedule(state, &state->render_idle);
 }
 
 int im_panel_init(struct wlpinyin_state *state) {
+	state->shm_pool_fd = -1;
+	state->retired_pool_fd = -1;
+	state->popup_shrink_timer.source.fd = -1;
+	state->popup_front = -1;
+	state->highlight_pool_fd = -1;
+	state->render_fd = -1;
+	state->render_source.fd = -1;
+	pthread_mutex_init(&state->render_lock, NULL);
+	pthread_cond_init(&state->render_cond, NULL);
+	arena_init(&state->render_job.arena, 4096);
+	arena_init(&state->render_arena, 4096);
+
 	if (!state->wl_shm) {
 		wlpinyin_err("wl_shm not available");
 		return -1;
 	}
 
+	if (!state->subcompositor) {
+		wlpinyin_err("wl_subcompositor not available");
+		return -1;
+	}
+
 	state->popup_surface = wl_compositor_create_surface(state->compositor);
 	if (!state->popup_surface) {
 		wlpinyin_err("failed to create popup surface");
@@ -250,35 +888,130 @@ int im_panel_init(struct wlpinyin_state *state) {
 	state->popup_surface_v2 = zwp_input_method_v2_get_input_popup_surface(
 			state->input_method, state->popup_surface);
 
-	state->shm_pool_fd = memfd_create("wlpinyin", 0);
-	if (state->shm_pool_fd < 0) {
-		wlpinyin_err("fail to create shm: %s", strerror(errno));
+	/* Synchronized child, its changes apply with the next popup commit */
+	state->highlight_surface = wl_compositor_create_surface(state->compositor);
+	if (!state->highlight_surface) {
+		wlpinyin_err("failed to create highlight surface");
 		return -1;
 	}
+	state->highlight_subsurface = wl_subcompositor_get_subsurface(
+			state->subcompositor, state->highlight_surface, state->popup_surface);
+	/* Under the grid, so it never tints the glyphs in its cell */
+	wl_subsurface_place_below(state->highlight_subsurface, state->popup_surface);
 
-	if (ftruncate(state->shm_pool_fd, DEFAULT_SHM_SIZE) < 0) {
-		wlpinyin_err("fail to init shm buffer: %s", strerror(errno));
-		close(state->shm_pool_fd);
+	if (popup_pool_create(state, DEFAULT_SHM_SIZE) != 0)
+		return -1;
+
+	if (loop_timer_init(state, &state->popup_shrink_timer, popup_handle_shrink,
+											NULL) != 0)
+		return -1;
+
+	state->frame_callback_done = true;
+	state->pending_render = true;
+	loop_idle_init(&state->render_idle, popup_render, NULL);
+
+	state->render_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (state->render_fd < 0) {
+		wlpinyin_err("failed to create render eventfd: %s", strerror(errno));
 		return -1;
 	}
+	if (loop_add(state, &state->render_source, state->render_fd, EPOLLIN,
+							 popup_handle_rendered, NULL) != 0)
+		return -1;
 
-	state->shm_pool =
-			wl_shm_create_pool(state->wl_shm, state->shm_pool_fd, DEFAULT_SHM_SIZE);
+	/* Idles until the first job, pango is only touched once warmup joined */
+	if (pthread_create(&state->render_thread, NULL, popup_render_thread,
+										 state) != 0) {
+		wlpinyin_err("failed to start render thread");
+		return -1;
+	}
+	state->render_threaded = true;
 
+	return 0;
+}
+
+int im_panel_warmup(struct wlpinyin_state *state) {
+	/*
+	 * Runs on a startup thread. The default font map is per thread, so use a
+	 * private one and shape/rasterize common glyphs once, the first popup then
+	 * finds fontconfig and the glyph caches loaded.
+	 */
+	state->popup_font_map = pango_cairo_font_map_new();
 	state->popup_pango_ctx =
-			pango_font_map_create_context(pango_cairo_font_map_get_default());
+			pango_font_map_create_context(state->popup_font_map);
 	state->popup_pango_layout = pango_layout_new(state->popup_pango_ctx);
+	if (!state->popup_pango_layout) {
+		wlpinyin_err("failed to create pango layout");
+		return -1;
+	}
 
-	state->frame_callback_done = true;
-	state->pending_render = true;
+	state->cand_cache = cand_cache_new();
+	if (!state->cand_cache) {
+		wlpinyin_err("failed to allocate candidate cache");
+		return -1;
+	}
+	const PangoFontDescription *desc =
+			pango_context_get_font_description(state->popup_pango_ctx);
+	cand_cache_clear(state->cand_cache, pango_font_description_hash(desc));
+
+	state->shaper = shaper_new(desc);
+	if (!state->shaper) {
+		wlpinyin_err("failed to start shaping workers");
+		return -1;
+	}
+
+	pango_layout_set_text(state->popup_pango_layout, POPUP_WARMUP_TEXT, -1);
+	PangoRectangle text_rect;
+	pango_layout_get_pixel_extents(state->popup_pango_layout, NULL, &text_rect);
+
+	cairo_surface_t *surface = cairo_image_surface_create(
+			CAIRO_FORMAT_ARGB32, MAX(1, text_rect.width), MAX(1, text_rect.height));
+	cairo_t *cr = cairo_create(surface);
+	pango_cairo_show_layout(cr, state->popup_pango_layout);
+	cairo_destroy(cr);
+	cairo_surface_destroy(surface);
 
 	return 0;
 }
 
 void im_panel_destroy(struct wlpinyin_state *state) {
-	if (state->shm_buffer) {
-		wl_buffer_destroy(state->shm_buffer);
-		state->shm_buffer = NULL;
+	loop_idle_cancel(state, &state->render_idle);
+	if (state->render_threaded) {
+		pthread_mutex_lock(&state->render_lock);
+		state->render_quit = true;
+		pthread_cond_signal(&state->render_cond);
+		pthread_mutex_unlock(&state->render_lock);
+		pthread_join(state->render_thread, NULL);
+		state->render_threaded = false;
+	}
+	if (state->popup_surface) {
+		loop_remove(state, &state->render_source);
+		if (state->render_fd >= 0) {
+			close(state->render_fd);
+			state->render_fd = -1;
+		}
+		arena_finish(&state->render_job.arena);
+		arena_finish(&state->render_arena);
+		loop_timer_finish(state, &state->popup_shrink_timer);
+		popup_pool_destroy(state);
+		popup_retired_destroy(state);
+		highlight_pool_destroy(state);
+	}
+	if (state->highlight_subsurface) {
+		wl_subsurface_destroy(state->highlight_subsurface);
+		state->highlight_subsurface = NULL;
+	}
+	if (state->highlight_surface) {
+		wl_surface_destroy(state->highlight_surface);
+		state->highlight_surface = NULL;
+	}
+	if (state->shaper) {
+		shaper_free(state->shaper);
+		state->shaper = NULL;
+	}
+	if (state->cand_cache) {
+		cand_cache_free(state->cand_cache);
+		state->cand_cache = NULL;
 	}
 	if (state->popup_pango_layout) {
 		g_object_unref(state->popup_pango_layout);
@@ -288,17 +1021,9 @@ void im_panel_destroy(struct wlpinyin_state *state) {
 		g_object_unref(state->popup_pango_ctx);
 		state->popup_pango_ctx = NULL;
 	}
-	if (state->popup_data) {
-		munmap(state->popup_data, state->shm_size);
-		state->popup_data = NULL;
-	}
-	if (state->shm_pool) {
-		wl_shm_pool_destroy(state->shm_pool);
-		state->shm_pool = NULL;
-	}
-	if (state->shm_pool_fd >= 0) {
-		close(state->shm_pool_fd);
-		state->shm_pool_fd = -1;
+	if (state->popup_font_map) {
+		g_object_unref(state->popup_font_map);
+		state->popup_font_map = NULL;
 	}
 	if (state->popup_surface_v2) {
 		zwp_input_popup_surface_v2_destroy(state->popup_surface_v2);
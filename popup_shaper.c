@@ -0,0 +1,165 @@
+#ifdef ENABLE_POPUP
+
+#include <pango/pango-fontmap.h>
+#include <pango/pangocairo.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "wlpinyin.h"
+
+#define SHAPER_MAX_WORKERS 3
+#define SHAPER_MIN_BATCH 8  // smaller batches are not worth waking anyone
+
+struct shaper {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	pthread_t threads[SHAPER_MAX_WORKERS];
+	int nworkers;
+	bool quit;
+	PangoFontDescription *desc;
+
+	// current batch, published under lock with a new generation
+	uint64_t generation;
+	const char *const *texts;
+	PangoRectangle *rects;
+	int n;
+	atomic_int next;  // next unclaimed index
+	int done;         // measured texts of the batch
+	int active;       // workers still inside the batch
+};
+
+static int shaper_run(struct shaper *shaper,
+											PangoLayout *layout,
+											const char *const *texts,
+											PangoRectangle *rects,
+											int n) {
+	int count = 0;
+	int i;
+	while ((i = atomic_fetch_add(&shaper->next, 1)) < n) {
+		pango_layout_set_text(layout, texts[i], -1);
+		pango_layout_get_pixel_extents(layout, NULL, &rects[i]);
+		count++;
+	}
+	return count;
+}
+
+static void *shaper_worker(void *data) {
+	struct shaper *shaper = data;
+
+	/* Pango font maps are not thread safe, each worker shapes with its own */
+	PangoFontMap *font_map = pango_cairo_font_map_new();
+	PangoContext *ctx = pango_font_map_create_context(font_map);
+	pango_context_set_font_description(ctx, shaper->desc);
+	PangoLayout *layout = pango_layout_new(ctx);
+
+	/* Load the font map before the first batch, not while a popup waits */
+	PangoRectangle rect;
+	pango_layout_set_text(layout, POPUP_WARMUP_TEXT, -1);
+	pango_layout_get_pixel_extents(layout, NULL, &rect);
+
+	pthread_mutex_lock(&shaper->lock);
+	uint64_t seen = shaper->generation;
+	for (;;) {
+		while (shaper->generation == seen && !shaper->quit)
+			pthread_cond_wait(&shaper->work_cond, &shaper->lock);
+		if (shaper->quit)
+			break;
+
+		seen = shaper->generation;
+		const char *const *texts = shaper->texts;
+		PangoRectangle *rects = shaper->rects;
+		int n = shaper->n;
+		shaper->active++;
+		pthread_mutex_unlock(&shaper->lock);
+
+		int count = shaper_run(shaper, layout, texts, rects, n);
+
+		pthread_mutex_lock(&shaper->lock);
+		shaper->done += count;
+		shaper->active--;
+		pthread_cond_broadcast(&shaper->done_cond);
+	}
+	pthread_mutex_unlock(&shaper->lock);
+
+	g_object_unref(layout);
+	g_object_unref(ctx);
+	g_object_unref(font_map);
+	return NULL;
+}
+
+struct shaper *shaper_new(const PangoFontDescription *desc) {
+	struct shaper *shaper = calloc(1, sizeof(struct shaper));
+	if (shaper == NULL)
+		return NULL;
+
+	pthread_mutex_init(&shaper->lock, NULL);
+	pthread_cond_init(&shaper->work_cond, NULL);
+	pthread_cond_init(&shaper->done_cond, NULL);
+	shaper->desc = pango_font_description_copy(desc);
+	atomic_init(&shaper->next, 0);
+
+	/* The calling thread shapes too, leave it a core */
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nworkers = CLAMP(cpus - 1, 0, SHAPER_MAX_WORKERS);
+	for (int i = 0; i < nworkers; i++) {
+		if (pthread_create(&shaper->threads[i], NULL, shaper_worker, shaper) != 0)
+			break;
+		shaper->nworkers++;
+	}
+	return shaper;
+}
+
+void shaper_free(struct shaper *shaper) {
+	pthread_mutex_lock(&shaper->lock);
+	shaper->quit = true;
+	pthread_cond_broadcast(&shaper->work_cond);
+	pthread_mutex_unlock(&shaper->lock);
+	for (int i = 0; i < shaper->nworkers; i++)
+		pthread_join(shaper->threads[i], NULL);
+
+	pango_font_description_free(shaper->desc);
+	pthread_cond_destroy(&shaper->done_cond);
+	pthread_cond_destroy(&shaper->work_cond);
+	pthread_mutex_destroy(&shaper->lock);
+	free(shaper);
+}
+
+void shaper_measure(struct shaper *shaper,
+										PangoLayout *layout,
+										const char *const *texts,
+										PangoRectangle *rects,
+										int n) {
+	if (shaper->nworkers == 0 || n < SHAPER_MIN_BATCH) {
+		for (int i = 0; i < n; i++) {
+			pango_layout_set_text(layout, texts[i], -1);
+			pango_layout_get_pixel_extents(layout, NULL, &rects[i]);
+		}
+		return;
+	}
+
+	/* A worker that woke late for the last batch may still hold its texts */
+	pthread_mutex_lock(&shaper->lock);
+	while (shaper->active > 0)
+		pthread_cond_wait(&shaper->done_cond, &shaper->lock);
+	shaper->texts = texts;
+	shaper->rects = rects;
+	shaper->n = n;
+	shaper->done = 0;
+	atomic_store(&shaper->next, 0);
+	shaper->generation++;
+	pthread_cond_broadcast(&shaper->work_cond);
+	pthread_mutex_unlock(&shaper->lock);
+
+	int count = shaper_run(shaper, layout, texts, rects, n);
+
+	/* Wait for every text, and for the workers to let go of the arrays */
+	pthread_mutex_lock(&shaper->lock);
+	shaper->done += count;
+	while (shaper->done < n || shaper->active > 0)
+		pthread_cond_wait(&shaper->done_cond, &shaper->lock);
+	pthread_mutex_unlock(&shaper->lock);
+}
+
+#endif /* ENABLE_POPUP */
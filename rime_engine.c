@@ -1,19 +1,61 @@
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <rime_api.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <glib.h>
 
 #include "wlpinyin.h"
 
+#define PAGE_CACHE_PAGES 32
+#define PREFETCH_PAGES 2  // pages fetched ahead of the current one when idle
+
+struct cand_page {
+	bool valid;
+	int count;
+	char **texts;
+};
+
 typedef struct engine {
 	RimeApi *api;
 	RimeTraits traits;
 	RimeSessionId sess;
 	char *user_dir;
-	im_context_t ctx;
 	im_preedit_t preedit;
 	char *commit_text;
-	RimeCandidateListIterator iter;
+	im_snapshot_t snap;
+	struct arena arena;  // commit, preedit and snapshot of the last keystroke
+	// Candidate pages of the current composition, kept across keystrokes
+	// until the preedit changes
+	struct arena page_arena;
+	uint64_t page_key;
+	// set by option and schema notifications, which arrive on whichever thread
+	// drives rime and change the candidates without touching the preedit
+	atomic_bool page_stale;
+	int last_page;  // -1 until the end of the candidate list was seen
+	struct cand_page pages[PAGE_CACHE_PAGES];
+	// ascii_mode of the session, kept from rime's option notifications so the
+	// key path does not have to ask
+	atomic_bool ascii_mode;
+	// schema id of the session, rime switches it on the worker's keys
+	pthread_mutex_t schema_lock;
+	char schema[RPC_SCHEMA_MAX];
+	enum im_deploy deploy_status;
+	int notify_fd;  // signaled by the maintenance thread when deploy ends
+	atomic_bool deploy_failed;
+	bool deploying;
+	uint64_t deploy_stamp;  // stamp of the data dirs this deploy is built from
+	pthread_t redeploy_thread;
+	bool redeploying;  // the session is paused until the deploy thread is done
+	uint64_t start_us;
 } rime_engine;
 
 static void im_engine_update_context(rime_engine *engine);
@@ -24,20 +66,490 @@ static void handle_notify(void *context_object,
 													const char *message_value) {
 	wlpinyin_dbg("context_obj: %p, sess: %ld, msgtype: %s, msg: %s",
 							 context_object, session_id, message_type, message_value);
+	rime_engine *engine = context_object;
+
+	// deploy notifications come from the maintenance thread
+	if (strcmp(message_type, "deploy") == 0) {
+		wlpinyin_info("deploy: %s", message_value);
+		if (strcmp(message_value, "success") == 0 ||
+				strcmp(message_value, "failure") == 0) {
+			atomic_store(&engine->deploy_failed,
+									 strcmp(message_value, "failure") == 0);
+			uint64_t one = 1;
+			write(engine->notify_fd, &one, sizeof(one));
+		}
+	} else if (strcmp(message_type, "option") == 0 &&
+						 session_id == engine->sess) {
+		if (strcmp(message_value, "ascii_mode") == 0)
+			atomic_store(&engine->ascii_mode, true);
+		else if (strcmp(message_value, "!ascii_mode") == 0)
+			atomic_store(&engine->ascii_mode, false);
+		atomic_store(&engine->page_stale, true);
+	} else if (strcmp(message_type, "schema") == 0 &&
+						 session_id == engine->sess) {
+		// value is "id/name"
+		size_t len = strcspn(message_value, "/");
+		if (len >= sizeof(engine->schema))
+			len = sizeof(engine->schema) - 1;
+		pthread_mutex_lock(&engine->schema_lock);
+		memcpy(engine->schema, message_value, len);
+		engine->schema[len] = '\0';
+		pthread_mutex_unlock(&engine->schema_lock);
+		atomic_store(&engine->page_stale, true);
+	}
+}
+
+static uint64_t get_microseconds() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+	const unsigned char *p = data;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// Sum of per-file hashes of path, size and mtime, independent of readdir
+// order. Outputs and state written by rime itself are skipped, otherwise every
+// deploy would invalidate its own stamp.
+static uint64_t deploy_stamp_dir(const char *dir, int depth) {
+	GDir *d = g_dir_open(dir, 0, NULL);
+	if (d == NULL)
+		return 0;
+
+	uint64_t stamp = 0;
+	const gchar *name;
+	while ((name = g_dir_read_name(d)) != NULL) {
+		if (strcmp(name, "build") == 0 || strcmp(name, "sync") == 0 ||
+				strcmp(name, "user.yaml") == 0 ||
+				strcmp(name, "installation.yaml") == 0 ||
+				g_str_has_suffix(name, ".userdb"))
+			continue;
+
+		gchar *path = g_build_filename(dir, name, NULL);
+		struct stat st;
+		if (stat(path, &st) == 0) {
+			if (S_ISDIR(st.st_mode)) {
+				if (depth > 0)
+					stamp += deploy_stamp_dir(path, depth - 1);
+			} else if (S_ISREG(st.st_mode)) {
+				uint64_t hash = 0xcbf29ce484222325ULL;
+				hash = fnv1a(hash, path, strlen(path));
+				hash = fnv1a(hash, &st.st_size, sizeof(st.st_size));
+				hash = fnv1a(hash, &st.st_mtim, sizeof(st.st_mtim));
+				stamp += hash;
+			}
+		}
+		g_free(path);
+	}
+	g_dir_close(d);
+	return stamp;
+}
+
+static uint64_t deploy_stamp(rime_engine *engine) {
+	uint64_t stamp = 0xcbf29ce484222325ULL;
+	const char *version = engine->traits.distribution_version;
+	stamp = fnv1a(stamp, version, strlen(version));
+	// Compiled formats are librime constants, a library upgrade rebuilds the
+	// .bin files even if the data is unchanged
+	RimeApi *api = engine->api;
+	if (RIME_STRUCT_HAS_MEMBER(*api, api->get_version) &&
+			api->get_version != NULL) {
+		const char *rime_version = api->get_version();
+		if (rime_version != NULL)
+			stamp = fnv1a(stamp, rime_version, strlen(rime_version));
+	}
+	stamp += deploy_stamp_dir(engine->traits.user_data_dir, 2);
+	stamp += deploy_stamp_dir(engine->traits.shared_data_dir, 2);
+	return stamp;
+}
+
+static char *deploy_stamp_path(rime_engine *engine) {
+	return g_build_filename(engine->user_dir, "build", "wlpinyin.stamp", NULL);
+}
+
+static bool deploy_stamp_matches(rime_engine *engine) {
+	char *path = deploy_stamp_path(engine);
+	FILE *f = fopen(path, "r");
+	g_free(path);
+	if (f == NULL)
+		return false;
+
+	uint64_t stored = 0;
+	bool matches = fscanf(f, "%" SCNx64, &stored) == 1 &&
+								 stored == engine->deploy_stamp;
+	fclose(f);
+	return matches;
+}
+
+static void deploy_stamp_save(rime_engine *engine) {
+	char *path = deploy_stamp_path(engine);
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		wlpinyin_err("failed to write deploy stamp %s", path);
+		g_free(path);
+		return;
+	}
+	fprintf(f, "%016" PRIx64 "\n", engine->deploy_stamp);
+	fclose(f);
+	g_free(path);
+}
+
+static void im_engine_create_session(rime_engine *engine) {
+	RimeApi *api = engine->api;
+
+	// https://github.com/DogLooksGood/emacs-rime/blob/b296856c21d32e700005110328fb6a1d48dcbf8d/lib.c#L136
+	api->join_maintenance_thread();
+
+	engine->sess = api->create_session();
+	if (engine->sess == 0) {
+		wlpinyin_err("failed to setup rime session");
+		return;
+	}
+
+	RimeSchemaList schemas;
+	api->get_schema_list(&schemas);
+	for (size_t i = 0; i < schemas.size; i++) {
+		wlpinyin_dbg("schema_name: %s, id: %s", schemas.list[i].name,
+								 schemas.list[i].schema_id);
+		if (api->select_schema(engine->sess, schemas.list[i].schema_id))
+			break;
+	}
+	api->free_schema_list(&schemas);
+
+	// The schema may switch options before the session id is known here
+	atomic_store(&engine->ascii_mode,
+							 api->get_option(engine->sess, "ascii_mode"));
+	pthread_mutex_lock(&engine->schema_lock);
+	if (!api->get_current_schema(engine->sess, engine->schema,
+															 sizeof(engine->schema)))
+		engine->schema[0] = '\0';
+	pthread_mutex_unlock(&engine->schema_lock);
+}
+
+// Create the session again from the freshly deployed data, with the schema
+// and mode it had when the redeploy paused it
+static void im_engine_resume_session(rime_engine *engine) {
+	RimeApi *api = engine->api;
+	char schema[RPC_SCHEMA_MAX];
+	pthread_mutex_lock(&engine->schema_lock);
+	snprintf(schema, sizeof(schema), "%s", engine->schema);
+	pthread_mutex_unlock(&engine->schema_lock);
+	bool ascii_mode = atomic_load(&engine->ascii_mode);
+
+	im_engine_create_session(engine);
+	if (engine->sess == 0)
+		return;
+	if (schema[0] != '\0' && api->select_schema(engine->sess, schema)) {
+		pthread_mutex_lock(&engine->schema_lock);
+		snprintf(engine->schema, sizeof(engine->schema), "%s", schema);
+		pthread_mutex_unlock(&engine->schema_lock);
+	}
+	api->set_option(engine->sess, "ascii_mode", ascii_mode);
+	atomic_store(&engine->ascii_mode, ascii_mode);
+	im_engine_update_context(engine);
+	wlpinyin_info("redeploy: session resumed");
+}
+
+static void *im_engine_redeploy_thread(void *data) {
+	rime_engine *engine = data;
+
+	// Rebuilding dictionaries must not compete with the keystroke path
+	struct sched_param param = {0};
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	setpriority(PRIO_PROCESS, gettid(), 19);
+
+	uint64_t start = get_microseconds();
+	engine->deploy_stamp = deploy_stamp(engine);
+	bool ok = engine->api->deploy();
+	atomic_store(&engine->deploy_failed, !ok);
+	wlpinyin_info("deploy: %s in %" PRIu64 "ms", ok ? "success" : "failure",
+								(get_microseconds() - start) / 1000);
+
+	uint64_t one = 1;
+	write(engine->notify_fd, &one, sizeof(one));
+	return NULL;
+}
+
+int im_engine_redeploy(rime_engine *engine) {
+	if (engine->sess == 0 || engine->deploying || engine->redeploying)
+		return -1;
+
+	// The deploy rewrites the .bin files the session has mapped, so the session
+	// goes away first, its dictionaries with it, and keys are passed through
+	// until im_engine_dispatch resumes it, as on startup
+	RimeApi *api = engine->api;
+	api->clear_composition(engine->sess);
+	im_engine_update_context(engine);
+	api->destroy_session(engine->sess);
+	engine->sess = 0;
+
+	wlpinyin_info("deploy: start");
+	if (pthread_create(&engine->redeploy_thread, NULL, im_engine_redeploy_thread,
+										 engine) != 0) {
+		wlpinyin_err("failed to start redeploy thread");
+		im_engine_resume_session(engine);
+		return -1;
+	}
+	engine->redeploying = true;
+	engine->deploy_status = IM_DEPLOY_START;
+	return 0;
+}
+
+enum im_deploy im_engine_deploy_status(rime_engine *engine) {
+	return engine->deploy_status;
+}
+
+void im_engine_schema(rime_engine *engine, char *buf, size_t size) {
+	pthread_mutex_lock(&engine->schema_lock);
+	snprintf(buf, size, "%s", engine->schema);
+	pthread_mutex_unlock(&engine->schema_lock);
+}
+
+static void snapshot_reset(im_snapshot_t *snap) {
+	snap->serial++;
+	snap->page_no = 0;
+	snap->page_size = 0;
+	snap->highlighted_index = 0;
+	snap->first = 0;
+	snap->count = 0;
+	snap->more = false;
+	snap->texts = NULL;
+	snap->labels = NULL;
+}
+
+static uint64_t page_cache_key(rime_engine *engine,
+															 const RimeContext *context) {
+	const RimeComposition *comp = &context->composition;
+	int fields[] = {comp->cursor_pos, comp->sel_start, comp->sel_end,
+									context->menu.page_size};
+	uint64_t hash = fnv1a(0xcbf29ce484222325ULL, &engine->sess,
+												sizeof(engine->sess));
+	hash = fnv1a(hash, fields, sizeof(fields));
+	if (comp->preedit)
+		hash = fnv1a(hash, comp->preedit, strlen(comp->preedit));
+	return hash;
+}
+
+static void page_cache_reset(rime_engine *engine, uint64_t key) {
+	arena_reset(&engine->page_arena);
+	memset(engine->pages, 0, sizeof(engine->pages));
+	engine->page_key = key;
+	engine->last_page = -1;
+}
+
+static bool page_cached(rime_engine *engine, int page_no) {
+	if (engine->last_page >= 0 && page_no > engine->last_page)
+		return true;  // past the end, nothing to fetch
+	return page_no < PAGE_CACHE_PAGES && engine->pages[page_no].valid;
+}
+
+// Fetch the missing pages of [from, to] in a single pass over the list
+static void page_cache_fetch(rime_engine *engine, int from, int to) {
+	int page_size = engine->snap.page_size;
+	to = MIN(to, PAGE_CACHE_PAGES - 1);
+	while (from <= to && page_cached(engine, from))
+		from++;
+	if (from > to)
+		return;
+
+	RimeCandidateListIterator iter = {0};
+	if (!engine->api->candidate_list_from_index(engine->sess, &iter,
+																							from * page_size))
+		return;
+
+	struct arena *arena = &engine->page_arena;
+	int page_no = from;
+	struct cand_page *page = NULL;
+	bool end = true;
+	while (engine->api->candidate_list_next(&iter)) {
+		if (page != NULL && page->count == page_size) {
+			page->valid = true;
+			if (++page_no > to) {
+				page = NULL;
+				end = false;
+				break;
+			}
+			page = NULL;
+		}
+		if (page == NULL) {
+			page = &engine->pages[page_no];
+			page->count = 0;
+			page->texts = arena_alloc(arena, page_size * sizeof(char *));
+		}
+		const char *text = iter.candidate.text;
+		page->texts[page->count++] = arena_strdup(arena, text ? text : "");
+	}
+	engine->api->candidate_list_end(&iter);
+
+	if (page != NULL)
+		page->valid = true;
+	if (end)
+		engine->last_page = page != NULL ? page_no : page_no - 1;
+}
+
+// Number of candidates in the list, INT_MAX while its end is unknown
+static int page_cache_total(rime_engine *engine) {
+	int last = engine->last_page;
+	if (last < 0)
+		return INT_MAX;
+	if (last < PAGE_CACHE_PAGES && engine->pages[last].valid)
+		return last * engine->snap.page_size + engine->pages[last].count;
+	return (last + 1) * engine->snap.page_size;
+}
+
+// The context already holds the current page, keep it instead of asking rime
+// for the candidate list again, it also replaces whatever the cache had for it
+static void snapshot_update(rime_engine *engine, const RimeContext *context) {
+	im_snapshot_t *snap = &engine->snap;
+	const RimeMenu *menu = &context->menu;
+
+	snap->page_no = menu->page_no;
+	snap->page_size = menu->page_size;
+	snap->highlighted_index = menu->highlighted_candidate_index;
+	snap->first = menu->page_no * menu->page_size;
+	snap->more = !menu->is_last_page;
+
+	struct arena *arena = &engine->arena;
+	snap->labels = arena_alloc(arena, MAX(1, snap->page_size) * sizeof(char *));
+	for (int i = 0; i < snap->page_size; i++) {
+		if (context->select_labels && context->select_labels[i])
+			snap->labels[i] = arena_strdup(arena, context->select_labels[i]);
+		else if (menu->select_keys && i < (int)strlen(menu->select_keys))
+			snap->labels[i] = arena_strndup(arena, &menu->select_keys[i], 1);
+		else
+			snap->labels[i] = arena_printf(arena, "%d", i + 1);
+	}
+
+	if (menu->page_size <= 0)
+		return;
+
+	// A new preedit or a switched option means a new candidate list, the
+	// cached pages are stale
+	uint64_t key = page_cache_key(engine, context);
+	if (atomic_exchange(&engine->page_stale, false) || key != engine->page_key)
+		page_cache_reset(engine, key);
+	if (menu->is_last_page)
+		engine->last_page = menu->page_no;
+
+	struct cand_page *page = NULL;
+	if (menu->page_no < PAGE_CACHE_PAGES)
+		page = &engine->pages[menu->page_no];
+
+	// Cached pages live in their own arena, the snapshot points into them
+	if (page != NULL)
+		arena = &engine->page_arena;
+	snap->texts =
+			arena_alloc(arena, MAX(1, menu->num_candidates) * sizeof(char *));
+	for (int i = 0; i < menu->num_candidates; i++) {
+		const char *text = menu->candidates[i].text;
+		snap->texts[snap->count++] = arena_strdup(arena, text ? text : "");
+	}
+	if (page != NULL) {
+		page->texts = snap->texts;
+		page->count = snap->count;
+		page->valid = true;
+	}
+}
+
+// Past the cached pages, read the range straight from the candidate list
+static const im_snapshot_t *snapshot_walk(rime_engine *engine,
+																					int first,
+																					int count) {
+	im_snapshot_t *snap = &engine->snap;
+	RimeCandidateListIterator iter = {0};
+	if (!engine->api->candidate_list_from_index(engine->sess, &iter, first))
+		return snap;
+
+	struct arena *arena = &engine->arena;
+	char **texts = arena_alloc(arena, count * sizeof(char *));
+	int n = 0;
+	bool more = false;
+	while (engine->api->candidate_list_next(&iter)) {
+		if (n == count) {
+			more = true;
+			break;
+		}
+		const char *text = iter.candidate.text;
+		texts[n++] = arena_strdup(arena, text ? text : "");
+	}
+	engine->api->candidate_list_end(&iter);
+
+	snap->texts = texts;
+	snap->count = n;
+	snap->first = first;
+	snap->more = more;
+	return snap;
+}
+
+const im_snapshot_t *im_engine_snapshot(rime_engine *engine,
+																				int first,
+																				int count) {
+	im_snapshot_t *snap = &engine->snap;
+	if (count <= 0 || engine->sess == 0 || snap->page_size <= 0)
+		return snap;
+
+	// Covered, or nothing exists past what we already have
+	int end = snap->first + snap->count;
+	if (first >= snap->first && (first + count <= end || !snap->more))
+		return snap;
+
+	// Serve the range from the page cache, fetching only the pages it misses
+	int page_size = snap->page_size;
+	int first_page = first / page_size;
+	int last_page = (first + count - 1) / page_size;
+	if (last_page >= PAGE_CACHE_PAGES)
+		return snapshot_walk(engine, first, count);
+	page_cache_fetch(engine, first_page, last_page);
+
+	// The previous texts stay in the arena until the next keystroke
+	char **texts = arena_alloc(&engine->arena, count * sizeof(char *));
+	int n = 0;
+	for (int p = first_page; p <= last_page && n < count; p++) {
+		struct cand_page *page = &engine->pages[p];
+		if (!page->valid)
+			break;
+		for (int i = MAX(0, first - p * page_size); i < page->count && n < count;
+				 i++)
+			texts[n++] = page->texts[i];
+		if (page->count < page_size)
+			break;
+	}
+
+	snap->texts = texts;
+	snap->count = n;
+	snap->first = first;
+	snap->more = n == count && first + count < page_cache_total(engine);
+	return snap;
+}
+
+void im_engine_prefetch(rime_engine *engine) {
+	im_snapshot_t *snap = &engine->snap;
+	if (engine->sess == 0 || snap->page_size <= 0 || !snap->more)
+		return;
+	page_cache_fetch(engine, snap->page_no + 1, snap->page_no + PREFETCH_PAGES);
 }
 
 static void im_engine_update_context(rime_engine *engine) {
 	RimeApi *api = engine->api;
 
+	// The previous keystroke's commit has been sent, drop all its strings
+	arena_reset(&engine->arena);
+	engine->commit_text = NULL;
+	engine->preedit.text = NULL;
+	snapshot_reset(&engine->snap);
+
 	// Get commit
 	RimeCommit commit = {0};
 	RIME_STRUCT_INIT(RimeCommit, commit);
-	if (engine->commit_text) {
-		free(engine->commit_text);
-		engine->commit_text = NULL;
-	}
 	if (api->get_commit(engine->sess, &commit)) {
-		engine->commit_text = strdup(commit.text ? commit.text : "");
+		engine->commit_text =
+				arena_strdup(&engine->arena, commit.text ? commit.text : "");
 		wlpinyin_dbg("commit_text: %s", engine->commit_text);
 		api->free_commit(&commit);
 	}
@@ -56,30 +568,23 @@ static void im_engine_update_context(rime_engine *engine) {
 								 context.menu.highlighted_candidate_index);
 
 		// Copy preedit
-		if (engine->preedit.text) {
-			free(engine->preedit.text);
-			engine->preedit.text = NULL;
-		}
+		const char *preedit = context.composition.preedit;
 		engine->preedit.text =
-				strdup(context.composition.preedit ? context.composition.preedit : "");
+				arena_strdup(&engine->arena, preedit ? preedit : "");
 		engine->preedit.begin = context.composition.sel_start;
 		engine->preedit.end = context.composition.sel_end;
 
-		// Copy candidates
-		engine->ctx.page_size = context.menu.page_size;
-		engine->ctx.page_no = context.menu.page_no;
-		engine->ctx.highlighted_index = context.menu.highlighted_candidate_index;
+		snapshot_update(engine, &context);
 
 		api->free_context(&context);
 	}
 }
 
-im_context_t im_engine_context(rime_engine *engine) {
-	return engine->ctx;
-}
-
 im_preedit_t im_engine_preedit(rime_engine *engine) {
-	return engine->preedit;
+	im_preedit_t preedit = engine->preedit;
+	if (preedit.text == NULL)
+		preedit.text = "";
+	return preedit;
 }
 
 rime_engine *im_engine_new() {
@@ -88,6 +593,18 @@ rime_engine *im_engine_new() {
 		return NULL;
 	}
 
+	engine->start_us = get_microseconds();
+	pthread_mutex_init(&engine->schema_lock, NULL);
+	arena_init(&engine->arena, 4096);
+	arena_init(&engine->page_arena, 4096);
+	engine->last_page = -1;
+	engine->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (engine->notify_fd == -1) {
+		wlpinyin_err("failed to create engine eventfd");
+		free(engine);
+		return NULL;
+	}
+
 	engine->api = rime_get_api();
 	if (engine->api == NULL) {
 		wlpinyin_err("failed to setup rime api");
@@ -103,7 +620,7 @@ rime_engine *im_engine_new() {
 	const gchar *config_dir = g_get_user_config_dir();
 	if (config_dir == NULL) {
 		im_engine_free(engine);
-		return false;
+		return NULL;
 	}
 
 	int size = snprintf(NULL, 0, "%s/wlpinyin", config_dir);
@@ -135,73 +652,121 @@ rime_engine *im_engine_new() {
 
 	api->initialize(&engine->traits);
 
-	api->start_maintenance(true);
+	// Deploy in the background, keys are passed through until the session is
+	// created by im_engine_dispatch. Nothing to deploy if the data dirs are
+	// unchanged since the last successful deploy.
+	engine->deploy_stamp = deploy_stamp(engine);
+	if (deploy_stamp_matches(engine)) {
+		wlpinyin_dbg("deploy stamp %016" PRIx64 " unchanged, skip deploy",
+								 engine->deploy_stamp);
+		uint64_t one = 1;
+		write(engine->notify_fd, &one, sizeof(one));
+	} else {
+		// cleared by the success notification
+		atomic_store(&engine->deploy_failed, true);
+		engine->deploying = true;
+		engine->deploy_status = IM_DEPLOY_START;
+		if (!api->start_maintenance(true)) {
+			uint64_t one = 1;
+			write(engine->notify_fd, &one, sizeof(one));
+		}
+	}
 
-	// wait for deploy
-	// https://github.com/DogLooksGood/emacs-rime/blob/b296856c21d32e700005110328fb6a1d48dcbf8d/lib.c#L136
-	api->join_maintenance_thread();
+	return engine;
+}
 
-	engine->sess = api->create_session();
-	if (engine->sess == 0) {
-		wlpinyin_err("failed to setup rime session");
-		im_engine_free(engine);
-		return NULL;
+int im_engine_fd(rime_engine *engine) {
+	return engine->notify_fd;
+}
+
+enum im_engine_event im_engine_dispatch(rime_engine *engine) {
+	uint64_t count;
+	if (read(engine->notify_fd, &count, sizeof(count)) != sizeof(count))
+		return IM_ENGINE_NONE;
+
+	if (engine->redeploying) {
+		pthread_join(engine->redeploy_thread, NULL);
+		engine->redeploying = false;
+		engine->deploy_status = atomic_load(&engine->deploy_failed)
+																? IM_DEPLOY_FAILURE
+																: IM_DEPLOY_SUCCESS;
+		// A failed deploy may have left some files rebuilt, whatever is there
+		// is better than no session at all
+		if (engine->deploy_status == IM_DEPLOY_SUCCESS)
+			deploy_stamp_save(engine);
+		im_engine_resume_session(engine);
+		return engine->sess != 0 ? IM_ENGINE_RESUMED : IM_ENGINE_NONE;
 	}
 
-	RimeSchemaList schemas;
-	api->get_schema_list(&schemas);
-	for (size_t i = 0; i < schemas.size; i++) {
-		wlpinyin_dbg("schema_name: %s, id: %s", schemas.list[i].name,
-								 schemas.list[i].schema_id);
-		if (api->select_schema(engine->sess, schemas.list[i].schema_id))
-			break;
+	// Rime notifies success from inside the maintenance thread, which may still
+	// be finishing here. Creating the session joins it, so no need to wait for
+	// is_maintenance_mode to clear, the eventfd would not fire again.
+	if (engine->sess != 0)
+		return IM_ENGINE_NONE;
+
+	if (engine->deploying) {
+		engine->deploy_status = atomic_load(&engine->deploy_failed)
+																? IM_DEPLOY_FAILURE
+																: IM_DEPLOY_SUCCESS;
+		if (engine->deploy_status == IM_DEPLOY_SUCCESS)
+			deploy_stamp_save(engine);
 	}
-	api->free_schema_list(&schemas);
+	engine->deploying = false;
 
-	return engine;
+	im_engine_create_session(engine);
+	wlpinyin_info("startup: engine ready in %" PRIu64 "ms",
+								(get_microseconds() - engine->start_us) / 1000);
+	return engine->sess != 0 ? IM_ENGINE_READY : IM_ENGINE_NONE;
+}
+
+bool im_engine_ready(rime_engine *engine) {
+	return engine->sess != 0;
 }
 
 void im_engine_free(rime_engine *engine) {
-	if (engine->preedit.text)
-		free(engine->preedit.text);
-	if (engine->commit_text)
-		free(engine->commit_text);
+	// the deploy thread reads the traits, their dirs must outlive it
+	if (engine->redeploying)
+		pthread_join(engine->redeploy_thread, NULL);
+	arena_finish(&engine->arena);
+	arena_finish(&engine->page_arena);
 	if (engine->user_dir != NULL)
 		free(engine->user_dir);
 	if (engine->traits.log_dir != NULL)
 		free((char *)engine->traits.log_dir);
-	engine->api->destroy_session(engine->sess);
-	engine->api->finalize();
+	if (engine->api != NULL) {
+		// is_maintenance_mode may already be false while the thread finishes,
+		// joining without one running is a no-op
+		engine->api->join_maintenance_thread();
+		if (engine->sess != 0)
+			engine->api->destroy_session(engine->sess);
+		engine->api->finalize();
+	}
+	// after the join, the maintenance thread writes it from its notifications
+	if (engine->notify_fd != -1)
+		close(engine->notify_fd);
+	pthread_mutex_destroy(&engine->schema_lock);
 	free(engine);
 }
 
-void im_engine_cand_begin(struct engine *engine, int off) {
-	engine->api->candidate_list_from_index(engine->sess, &engine->iter, off);
-}
-
-const char *im_engine_cand_get(struct engine *engine) {
-	return engine->iter.candidate.text ? engine->iter.candidate.text : "";
-}
-
-bool im_engine_cand_next(struct engine *engine) {
-	return engine->api->candidate_list_next(&engine->iter);
-}
-
-void im_engine_cand_end(struct engine *engine) {
-	engine->api->candidate_list_end(&engine->iter);
-}
-
 const char *im_engine_commit(struct engine *engine) {
 	return engine->commit_text ? engine->commit_text : "";
 }
 
-bool im_engine_key(rime_engine *engine,
+int im_engine_key(rime_engine *engine,
 									 xkb_keysym_t keycode,
-									 xkb_mod_mask_t mods) {
-	bool handled = engine->api->process_key(engine->sess, keycode, mods);
-	if (handled)
+									 xkb_mod_mask_t mods,
+									 int count) {
+	if (engine->sess == 0)
+		return 0;
+
+	// Repeated presses share one context update, rime accumulates the commit
+	int taken = 0;
+	while (taken < count &&
+				 engine->api->process_key(engine->sess, keycode, mods))
+		taken++;
+	if (taken > 0)
 		im_engine_update_context(engine);
-	return handled;
+	return taken;
 }
 
 void im_engine_toggle(rime_engine *engine) {
@@ -210,16 +775,23 @@ void im_engine_toggle(rime_engine *engine) {
 }
 
 void im_engine_reset(rime_engine *engine) {
+	if (engine->sess == 0)
+		return;
 	engine->api->clear_composition(engine->sess);
 	im_engine_update_context(engine);
 }
 
 bool im_engine_get_ascii_mode(rime_engine *engine) {
-	return engine->api->get_option(engine->sess, "ascii_mode");
+	if (engine->sess == 0)
+		return false;
+	return atomic_load(&engine->ascii_mode);
 }
 
 void im_engine_set_ascii_mode(rime_engine *engine, bool ascii_mode) {
+	if (engine->sess == 0)
+		return;
 	engine->api->set_option(engine->sess, "ascii_mode", ascii_mode);
+	atomic_store(&engine->ascii_mode, ascii_mode);
 	engine->api->commit_composition(engine->sess);
 	im_engine_update_context(engine);
 }
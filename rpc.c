@@ -1,14 +1,45 @@
+#include <errno.h>
 #include <glib.h>
-#include <poll.h>
+#include <inttypes.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 #include "wlpinyin.h"
 
+#define RPC_MAX_CLIENTS 32
+#define RPC_LINE_MAX 256     // longer commands are rejected
+#define RPC_OUTPUT_MAX 65536  // queued replies before a client is dropped
+
+/*
+ * One connection. Commands are read into a line buffer and answered in order,
+ * replies queue in output while the socket is full so a slow reader never
+ * blocks the loop or the other clients.
+ */
+struct rpc_client {
+	struct loop_source source;  // fd -1 once closed
+	struct rpc_client *next;
+	char line[RPC_LINE_MAX];
+	size_t line_len;
+	bool overlong;  // discarding a line that did not fit, up to its newline
+	char *output;
+	size_t output_len;
+	size_t output_cap;
+	bool writing;  // waiting for EPOLLOUT to send the rest of output
+	bool eof;      // the client shut down its side, close after the replies
+	bool subscribed;
+};
+
+static void rpc_accept(struct wlpinyin_state *state,
+											 uint32_t events,
+											 void *data);
+static void rpc_reap(struct wlpinyin_state *state, void *data);
+
 int rpc_init(struct wlpinyin_state *state) {
 	const char *dir = g_get_user_runtime_dir();
 	if (dir == NULL) {
@@ -51,7 +82,7 @@ int rpc_init(struct wlpinyin_state *state) {
 	}
 
 	// Allow multiple pending connections in backlog
-	if (listen(fd, 5) == -1) {
+	if (listen(fd, RPC_MAX_CLIENTS) == -1) {
 		wlpinyin_err("failed to listen on socket");
 		close(fd);
 		g_free(path);
@@ -60,78 +91,388 @@ int rpc_init(struct wlpinyin_state *state) {
 
 	state->rpc_fd = fd;
 	state->rpc_socket_path = path;
-	state->rpc_client = -1;
+	state->rpc_clients = NULL;
+	state->rpc_nclients = 0;
+	loop_idle_init(&state->rpc_reap_idle, rpc_reap, NULL);
+
+	if (loop_add(state, &state->rpc_source, fd, EPOLLIN, rpc_accept, NULL) !=
+			0) {
+		return -1;
+	}
 
 	wlpinyin_dbg("rpc socket listening at %s", path);
 	return 0;
 }
 
-static void rpc_close_client(struct wlpinyin_state *state) {
-	if (state->rpc_client != -1) {
-		close(state->rpc_client);
-		state->rpc_client = -1;
-		wlpinyin_dbg("rpc client disconnected");
+static void rpc_close_client(struct wlpinyin_state *state,
+														 struct rpc_client *client) {
+	int fd = client->source.fd;
+	if (fd == -1)
+		return;
+	// Events for it may still be pending in this dispatch, free it when idle
+	loop_remove(state, &client->source);
+	close(fd);
+	state->rpc_nclients--;
+	loop_idle_schedule(state, &state->rpc_reap_idle);
+	wlpinyin_dbg("rpc client disconnected, %d left", state->rpc_nclients);
+}
+
+static void rpc_free_client(struct rpc_client *client) {
+	free(client->output);
+	free(client);
+}
+
+static void rpc_reap(struct wlpinyin_state *state, void *data) {
+	UNUSED(data);
+	struct rpc_client **link = &state->rpc_clients;
+	while (*link != NULL) {
+		struct rpc_client *client = *link;
+		if (client->source.fd != -1) {
+			link = &client->next;
+			continue;
+		}
+		*link = client->next;
+		rpc_free_client(client);
 	}
 }
 
-void rpc_accept(struct wlpinyin_state *state) {
-	// Only accept if no existing client
-	if (state->rpc_client != -1) {
-		return;
+static void rpc_flush(struct wlpinyin_state *state, struct rpc_client *client) {
+	size_t sent = 0;
+	while (sent < client->output_len) {
+		ssize_t n = send(client->source.fd, client->output + sent,
+										 client->output_len - sent, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n == -1) {
+			rpc_close_client(state, client);
+			return;
+		}
+		sent += n;
+	}
+	if (sent > 0) {
+		memmove(client->output, client->output + sent, client->output_len - sent);
+		client->output_len -= sent;
 	}
 
-	int client = accept4(state->rpc_fd, NULL, NULL, SOCK_NONBLOCK);
-	if (client != -1) {
-		state->rpc_client = client;
-		wlpinyin_dbg("rpc client connected");
+	// A client that hung up is closed once it got all its replies, unless it
+	// still listens for events
+	if (client->eof && !client->subscribed && client->output_len == 0) {
+		rpc_close_client(state, client);
+		return;
 	}
+	bool writing = client->output_len > 0;
+	if (writing == client->writing)
+		return;
+	client->writing = writing;
+	uint32_t events = (client->eof ? 0 : EPOLLIN) | (writing ? EPOLLOUT : 0);
+	loop_modify(state, &client->source, events);
 }
 
-void rpc_handle_client_data(struct wlpinyin_state *state) {
-	if (state->rpc_client == -1)
+// Queue a reply, the caller flushes once it answered everything it read
+static void rpc_send(struct wlpinyin_state *state,
+										 struct rpc_client *client,
+										 const char *data,
+										 size_t len) {
+	if (client->source.fd == -1)
 		return;
+	if (client->output_len + len > RPC_OUTPUT_MAX) {
+		wlpinyin_err("rpc client does not read its replies, dropped");
+		rpc_close_client(state, client);
+		return;
+	}
+	if (client->output_len + len > client->output_cap) {
+		size_t cap = client->output_cap ? client->output_cap : 256;
+		while (cap < client->output_len + len)
+			cap *= 2;
+		char *output = realloc(client->output, cap);
+		if (output == NULL) {
+			rpc_close_client(state, client);
+			return;
+		}
+		client->output = output;
+		client->output_cap = cap;
+	}
+	memcpy(client->output + client->output_len, data, len);
+	client->output_len += len;
+}
+
+static void rpc_reply(struct wlpinyin_state *state,
+											struct rpc_client *client,
+											const char *reply) {
+	rpc_send(state, client, reply, strlen(reply));
+}
+
+static void rpc_status_read(struct wlpinyin_state *state,
+														struct rpc_status *status) {
+	status->ascii_mode = im_engine_get_ascii_mode(state->engine);
+	status->deploy = im_engine_deploy_status(state->engine);
+	im_engine_schema(state->engine, status->schema, sizeof(status->schema));
+}
+
+// Event lines for what changed since old, or for all of status without old
+static int rpc_status_events(const struct rpc_status *status,
+														 const struct rpc_status *old,
+														 char *buf,
+														 size_t size) {
+	static const char *const deploy_names[] = {
+			[IM_DEPLOY_START] = "start",
+			[IM_DEPLOY_SUCCESS] = "success",
+			[IM_DEPLOY_FAILURE] = "failure",
+	};
+	int len = 0;
+	if (old == NULL || status->ascii_mode != old->ascii_mode)
+		len += snprintf(buf + len, size - len, "event mode %s\n",
+										status->ascii_mode ? "disable" : "enable");
+	if (status->schema[0] != '\0' &&
+			(old == NULL || strcmp(status->schema, old->schema) != 0))
+		len += snprintf(buf + len, size - len, "event schema %s\n",
+										status->schema);
+	if (status->deploy != IM_DEPLOY_NONE &&
+			(old == NULL || status->deploy != old->deploy))
+		len += snprintf(buf + len, size - len, "event deploy %s\n",
+										deploy_names[status->deploy]);
+	return len;
+}
 
-	char buf[256] = {0};
-	ssize_t n = read(state->rpc_client, buf, sizeof(buf) - 1);
+void rpc_notify(struct wlpinyin_state *state) {
+	struct rpc_status status;
+	rpc_status_read(state, &status);
 
-	if (n <= 0) {
-		// Connection closed or error
-		rpc_close_client(state);
+	char events[RPC_SCHEMA_MAX + 64];
+	int len = rpc_status_events(&status, &state->rpc_status, events,
+															sizeof(events));
+	state->rpc_status = status;
+	if (len == 0)
 		return;
-	}
 
-	// Strip trailing \r\n or \n
-	while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r')) {
-		buf[--n] = '\0';
+	for (struct rpc_client *client = state->rpc_clients; client != NULL;
+			 client = client->next) {
+		if (client->source.fd == -1 || !client->subscribed)
+			continue;
+		rpc_send(state, client, events, len);
+		if (client->source.fd != -1)
+			rpc_flush(state, client);
 	}
+}
 
-	wlpinyin_dbg("rpc client command: %s", buf);
-	if (strcmp(buf, "enable") == 0) {
+static void rpc_handle_command(struct wlpinyin_state *state,
+															 struct rpc_client *client,
+															 const char *cmd) {
+	wlpinyin_dbg("rpc client command: %s", cmd);
+	if (strcmp(cmd, "enable") == 0) {
 		// Enable Chinese input: turn off ascii_mode
+		key_queue_sync(state->keys);
 		im_engine_set_ascii_mode(state->engine, false);
-		write(state->rpc_client, "ok\n", 3);
-	} else if (strcmp(buf, "disable") == 0) {
+		rpc_reply(state, client, "ok\n");
+	} else if (strcmp(cmd, "disable") == 0) {
 		// Disable Chinese input: turn on ascii_mode
+		key_queue_sync(state->keys);
 		im_engine_set_ascii_mode(state->engine, true);
-		write(state->rpc_client, "ok\n", 3);
-	} else if (strcmp(buf, "toggle") == 0) {
+		rpc_reply(state, client, "ok\n");
+	} else if (strcmp(cmd, "toggle") == 0) {
 		// Toggle ascii_mode
+		key_queue_sync(state->keys);
 		im_engine_toggle(state->engine);
-		write(state->rpc_client, "ok\n", 3);
-	} else if (strcmp(buf, "status") == 0) {
-		// Query current status
+		rpc_reply(state, client, "ok\n");
+	} else if (strcmp(cmd, "status") == 0) {
+		// Query current status, the cached mode needs no engine
 		bool ascii_mode = im_engine_get_ascii_mode(state->engine);
-		const char *status = ascii_mode ? "disable\n" : "enable\n";
-		write(state->rpc_client, status, strlen(status));
+		rpc_reply(state, client, ascii_mode ? "disable\n" : "enable\n");
+	} else if (strcmp(cmd, "subscribe") == 0) {
+		// Push events from now on, starting with the current status
+		char events[RPC_SCHEMA_MAX + 64];
+		rpc_notify(state);
+		int len =
+				rpc_status_events(&state->rpc_status, NULL, events, sizeof(events));
+		client->subscribed = true;
+		rpc_reply(state, client, "ok\n");
+		rpc_send(state, client, events, len);
+	} else if (strcmp(cmd, "unsubscribe") == 0) {
+		client->subscribed = false;
+		rpc_reply(state, client, "ok\n");
+	} else if (strcmp(cmd, "redeploy") == 0) {
+		// Rebuild schemas and dictionaries in the background
+		key_queue_sync(state->keys);
+		if (im_engine_redeploy(state->engine) == 0) {
+			// the session is paused, take its composition off the screen
+			if (state->im_activated) {
+				im_panel_update(state);
+				im_commit(state);
+			}
+			rpc_reply(state, client, "ok\n");
+		} else
+			rpc_reply(state, client, "error: deploy in progress\n");
+	} else if (strcmp(cmd, "stats") == 0) {
+		// Query key handling statistics
+		const struct wlpinyin_stats *stats = &state->stats;
+		uint64_t mallocs, frees;
+		arena_counters(&mallocs, &frees);
+		char reply[768];
+		int len = snprintf(reply, sizeof(reply),
+											 "keys %" PRIu64 " key_latency_avg_us %" PRIu64
+											 " key_latency_max_us %" PRIu64
+											 " event_latency_avg_us %" PRIu64
+											 " event_latency_max_us %" PRIu64 " arena_mallocs %" PRIu64
+											 " arena_frees %" PRIu64 " measure_hits %" PRIu64
+											 " measure_misses %" PRIu64 " frames %" PRIu64
+											 " draw_avg_us %" PRIu64 " draw_max_us %" PRIu64
+											 " suppressed_preedits %" PRIu64
+											 " suppressed_commits %" PRIu64
+											 " suppressed_hides %" PRIu64 " stalls %" PRIu64
+											 " stall_max_us %" PRIu64 " rpc_clients %d\n",
+											 stats->keys,
+											 stats->keys ? stats->key_latency_us_sum / stats->keys : 0,
+											 stats->key_latency_us_max,
+											 stats->keys ? stats->event_latency_us_sum / stats->keys : 0,
+											 stats->event_latency_us_max, mallocs, frees,
+											 stats->measure_hits, stats->measure_misses,
+											 stats->frames,
+											 stats->frames ? stats->draw_us_sum / stats->frames : 0,
+											 stats->draw_us_max, stats->suppressed_preedits,
+											 stats->suppressed_commits, stats->suppressed_hides,
+											 stats->stalls, stats->stall_us_max,
+											 state->rpc_nclients);
+		rpc_send(state, client, reply, len);
 	} else {
-		write(state->rpc_client, "error: unknown command\n", 23);
+		rpc_reply(state, client, "error: unknown command\n");
+	}
+}
+
+// Split what was read into lines, a command may span several reads and one
+// read may carry several commands
+static void rpc_handle_input(struct wlpinyin_state *state,
+														 struct rpc_client *client,
+														 const char *data,
+														 size_t len) {
+	while (len > 0 && client->source.fd != -1) {
+		const char *newline = memchr(data, '\n', len);
+		size_t chunk = newline ? (size_t)(newline - data) : len;
+		if (client->line_len + chunk >= sizeof(client->line))
+			client->overlong = true;
+		else if (!client->overlong)
+			memcpy(client->line + client->line_len, data, chunk);
+		if (!client->overlong)
+			client->line_len += chunk;
+		if (newline == NULL)
+			return;
+		data += chunk + 1;
+		len -= chunk + 1;
+
+		size_t line_len = client->line_len;
+		if (line_len > 0 && client->line[line_len - 1] == '\r')
+			line_len--;
+		client->line[line_len] = '\0';
+		if (client->overlong)
+			rpc_reply(state, client, "error: command too long\n");
+		else if (line_len > 0)
+			rpc_handle_command(state, client, client->line);
+		client->line_len = 0;
+		client->overlong = false;
+	}
+}
+
+static void rpc_handle_client(struct wlpinyin_state *state,
+															uint32_t events,
+															void *data) {
+	struct rpc_client *client = data;
+	if (client->source.fd == -1)
+		return;
+	if (client->eof && (events & (EPOLLHUP | EPOLLERR))) {
+		rpc_close_client(state, client);
+		return;
+	}
+
+	if (events & EPOLLOUT) {
+		rpc_flush(state, client);
+		if (client->source.fd == -1)
+			return;
+	}
+	if (client->eof || !(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return;
+
+	// Bounded per wakeup, a client writing nonstop must not starve the others
+	char buf[1024];
+	for (int i = 0; i < 4 && client->source.fd != -1; i++) {
+		ssize_t n = read(client->source.fd, buf, sizeof(buf));
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n == -1) {
+			rpc_close_client(state, client);
+			return;
+		}
+		if (n == 0) {
+			// A last command without newline still counts, as before
+			if (client->line_len > 0 || client->overlong)
+				rpc_handle_input(state, client, "\n", 1);
+			client->eof = true;
+			break;
+		}
+		rpc_handle_input(state, client, buf, n);
+	}
+
+	// Mode and deploy changes from these commands reach every subscriber
+	rpc_notify(state);
+	if (client->source.fd == -1)
+		return;
+	rpc_flush(state, client);
+	// After eof only replies and events are left to send
+	if (client->source.fd != -1 && client->eof)
+		loop_modify(state, &client->source, client->writing ? EPOLLOUT : 0);
+}
+
+static void rpc_accept(struct wlpinyin_state *state,
+											 uint32_t events,
+											 void *data) {
+	UNUSED(events);
+	UNUSED(data);
+	for (;;) {
+		int fd = accept4(state->rpc_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				wlpinyin_err("failed to accept rpc client: %s", strerror(errno));
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		if (state->rpc_nclients >= RPC_MAX_CLIENTS) {
+			wlpinyin_err("too many rpc clients");
+			close(fd);
+			continue;
+		}
+
+		struct rpc_client *client = calloc(1, sizeof(struct rpc_client));
+		if (client == NULL) {
+			close(fd);
+			continue;
+		}
+		if (loop_add(state, &client->source, fd, EPOLLIN, rpc_handle_client,
+								 client) != 0) {
+			close(fd);
+			free(client);
+			continue;
+		}
+		client->next = state->rpc_clients;
+		state->rpc_clients = client;
+		state->rpc_nclients++;
+		wlpinyin_dbg("rpc client connected, %d in total", state->rpc_nclients);
 	}
 }
 
 void rpc_destroy(struct wlpinyin_state *state) {
-	rpc_close_client(state);
+	while (state->rpc_clients != NULL) {
+		struct rpc_client *client = state->rpc_clients;
+		state->rpc_clients = client->next;
+		rpc_close_client(state, client);
+		rpc_free_client(client);
+	}
+	loop_idle_cancel(state, &state->rpc_reap_idle);
 
 	if (state->rpc_fd != -1) {
+		loop_remove(state, &state->rpc_source);
 		close(state->rpc_fd);
 	}
 	if (state->rpc_socket_path != NULL) {
@@ -1,6 +1,5 @@
 #ifndef ENABLE_POPUP
 
-#include <stdio.h>
 #include <string.h>
 
 #include "wlpinyin.h"
@@ -10,39 +9,42 @@ int im_panel_init(struct wlpinyin_state *state) {
 	return 0;
 }
 
+int im_panel_warmup(struct wlpinyin_state *state) {
+	UNUSED(state);
+	return 0;
+}
+
 void im_panel_destroy(struct wlpinyin_state *state) {
 	UNUSED(state);
 }
 
 int im_panel_update(struct wlpinyin_state *state) {
 	im_preedit_t preedit = im_engine_preedit(state->engine);
-	im_context_t ctx = im_engine_context(state->engine);
-
-	char buf[2048] = {0};
-	int bufptr = 0;
 
-	if (!preedit.text || strlen(preedit.text) == 0) {
-		zwp_input_method_v2_set_preedit_string(state->input_method, "", 0, 0);
+	if (strlen(preedit.text) == 0) {
+		im_set_preedit(state, "", 0, 0);
 		return 0;
 	}
 
-	bufptr += snprintf(&buf[bufptr], sizeof buf - bufptr, "[%d] ", ctx.page_no);
-	int preedit_begin = bufptr + preedit.begin;
-	int preedit_end = bufptr + preedit.end;
-	bufptr += snprintf(&buf[bufptr], sizeof buf - bufptr, "%s", preedit.text);
+	struct arena *arena = &state->frame_arena;
+	arena_reset(arena);
+
+	const im_snapshot_t *snap = im_engine_snapshot(state->engine, 0, 0);
+	char *buf = arena_printf(arena, "[%d] ", snap->page_no);
+	int preedit_begin = strlen(buf) + preedit.begin;
+	int preedit_end = strlen(buf) + preedit.end;
+	buf = arena_append(arena, buf, "%s", preedit.text);
 
-	im_engine_cand_begin(state->engine, 0);
-	for (int i = 0; i < ctx.page_size && im_engine_cand_next(state->engine);
+	int first = snap->page_no * snap->page_size;
+	snap = im_engine_snapshot(state->engine, first, snap->page_size);
+	for (int i = 0; i < snap->page_size && first + i < snap->first + snap->count;
 			 i++) {
-		bool highlighted = i == ctx.highlighted_index;
-		const char *text = im_engine_cand_get(state->engine);
-		bufptr += snprintf(&buf[bufptr], sizeof buf - bufptr, " %s%d %s%s",
-											 highlighted ? "[" : "", i + 1, text ? text : "",
-											 highlighted ? "]" : "");
+		bool highlighted = i == snap->highlighted_index;
+		const char *text = snap->texts[first + i - snap->first];
+		buf = arena_append(arena, buf, " %s%s %s%s", highlighted ? "[" : "",
+											 snap->labels[i], text, highlighted ? "]" : "");
 	}
-	im_engine_cand_end(state->engine);
-	zwp_input_method_v2_set_preedit_string(state->input_method, buf,
-																				 preedit_begin, preedit_end);
+	im_set_preedit(state, buf, preedit_begin, preedit_end);
 	return 0;
 }
 
@@ -11,37 +11,267 @@
 #include "virtual-keyboard-unstable-v1-client-protocol.h"
 
 #ifdef ENABLE_POPUP
+#include <cairo.h>
 #include <pango/pango.h>
+#include <pthread.h>
 #endif
 
 // user config
 bool im_toggle(struct xkb_state *xkb, xkb_keysym_t keysym, bool pressed);
 
+enum im_mode {
+	IM_MODE_RIME,         // keys go through rime and the panel
+	IM_MODE_PASSTHROUGH,  // keys go straight to the virtual keyboard
+};
+// mode of a text field, from its text-input-v3 content hint and purpose
+enum im_mode im_content_mode(uint32_t hint, uint32_t purpose);
+
+#ifndef KEY_BUDGET_MS
+#define KEY_BUDGET_MS 50  // keys answered later than this are logged as stalls
+#endif
+
 // internal
 struct engine;
+struct key_queue;
+struct rpc_client;
+struct wlpinyin_state;
+
+typedef void (*loop_fd_cb)(struct wlpinyin_state *, uint32_t events, void *data);
+typedef void (*loop_timer_cb)(struct wlpinyin_state *,
+															uint64_t expirations,
+															void *data);
+typedef void (*loop_idle_cb)(struct wlpinyin_state *, void *data);
+
+struct loop_source {
+	int fd;
+	loop_fd_cb cb;
+	void *data;
+};
+
+struct loop_timer {
+	struct loop_source source;
+	loop_timer_cb cb;
+	void *data;
+};
+
+// deferred task, runs once per schedule when no input is pending
+struct loop_idle {
+	loop_idle_cb cb;
+	void *data;
+	bool queued;
+	struct loop_idle *next;
+};
+
+// Bump allocator for strings that live for one keystroke, reset in one step
+struct arena_chunk;
+struct arena {
+	struct arena_chunk *head;
+	size_t chunk_size;
+	void *last;  // latest allocation, arena_append grows it in place
+};
+
+struct wlpinyin_stats {
+	uint64_t keys;
+	uint64_t key_latency_us_sum;
+	uint64_t key_latency_us_max;
+	// from the compositor's timestamp of each key, so time spent queued
+	// before the loop woke counts too, at its millisecond resolution
+	uint64_t event_latency_us_sum;
+	uint64_t event_latency_us_max;
+	uint64_t measure_hits;
+	uint64_t measure_misses;
+	uint64_t frames;  // popup frames rasterized
+	uint64_t draw_us_sum;
+	uint64_t draw_us_max;
+	uint64_t suppressed_preedits;  // unchanged preedits not sent
+	uint64_t suppressed_commits;   // input method commits with nothing new
+	uint64_t suppressed_hides;     // popup already hidden
+	uint64_t stalls;               // keys over KEY_BUDGET_MS
+	uint64_t stall_us_max;         // slowest key answered by the rime worker
+};
+
+#define KEYMAP_CACHE_SIZE 4
+#define KEYMAP_ROWS 6  // none, shift and caps lock, with and without num lock
+
+// A compiled keymap, and the keysyms of its first layout under common
+// modifier states so most keys skip the xkb_state lookup
+struct keymap_entry {
+	uint64_t hash;  // content hash of the keymap string
+	size_t size;
+	struct xkb_keymap *keymap;
+	xkb_mod_mask_t row_mods[KEYMAP_ROWS];
+	xkb_keycode_t min_keycode;
+	xkb_keycode_t max_keycode;
+	xkb_keysym_t *syms;  // KEYMAP_ROWS rows of keycodes min to max
+	uint64_t used;       // lru stamp
+};
+
+enum im_deploy {
+	IM_DEPLOY_NONE,  // nothing deployed since startup
+	IM_DEPLOY_START,
+	IM_DEPLOY_SUCCESS,
+	IM_DEPLOY_FAILURE,
+};
+
+// what a wakeup of the engine fd brought about
+enum im_engine_event {
+	IM_ENGINE_NONE,
+	IM_ENGINE_READY,    // first session, after the startup deploy
+	IM_ENGINE_RESUMED,  // session created again after a redeploy
+};
+
+#define RPC_SCHEMA_MAX 128
+
+// engine status as rpc subscribers last heard it
+struct rpc_status {
+	bool ascii_mode;
+	enum im_deploy deploy;
+	char schema[RPC_SCHEMA_MAX];
+};
+
+#ifdef ENABLE_POPUP
+#define POPUP_BUFFERS 3
+#define POPUP_MAX_COLS 50
+#define POPUP_MAX_CELLS 256
+// common glyphs shaped at startup, so fontconfig and the caches are loaded
+#define POPUP_WARMUP_TEXT "1 2 3 4 5 6 7 8 9 0 的一是不了人我在有他这中大来上"
+
+// one slot of the popup shm pool
+struct popup_buffer {
+	struct wl_buffer *buffer;
+	int width, height, stride;
+	bool busy;  // attached, until the compositor sends wl_buffer.release
+	// what the slot holds, to repaint only the cells that changed
+	uint64_t layout;  // 0 when the contents are unknown
+	uint64_t cells[POPUP_MAX_CELLS];
+};
+
+#define POPUP_HIGHLIGHTS 16
+
+// what the render thread draws, copied from the engine snapshot
+struct popup_job {
+	struct arena arena;  // strings below, reset per job
+	int page_size, page_no, highlighted_index;
+	int start_row;
+	int ncands;
+	char **texts;   // from the first candidate of start_row
+	char **labels;  // page_size
+};
+
+// what the render thread drew, for the main thread to present
+struct popup_frame {
+	int slot;        // buffer to attach, -1 if the grid on screen is still right
+	bool no_buffer;  // every slot was busy
+	int page_size;
+	int ncells;
+	int highlighted;  // cell index, -1 when not shown
+	int row_height;
+	int row_width[POPUP_MAX_COLS];
+	int col_x[POPUP_MAX_COLS];
+	bool full_damage;
+	bool damaged[POPUP_MAX_CELLS];
+	uint64_t measure_hits;
+	uint64_t measure_misses;
+	uint64_t draw_us;  // fills, tiles and blits
+};
+
+// solid highlight of one cell size, immutable once created
+struct popup_highlight {
+	struct wl_buffer *buffer;
+	int width, height;
+};
+#endif
 
 struct wlpinyin_state {
 	int signalfd;
 	struct wl_display *display;
 
+	int epoll_fd;
+	struct loop_idle *idle_head;
+	struct loop_idle *idle_tail;
+	struct loop_source signal_source;
+	struct loop_source wayland_source;
+	struct loop_source rpc_source;
+	struct loop_source engine_source;
+	struct loop_timer stats_timer;
+	struct loop_idle stats_idle;
+	uint64_t stats_logged_keys;  // keys at the last stats log
+	struct loop_timer prefetch_timer;  // rearmed by every key
+	// Client side repeat of the key rime took last, while it is held
+	struct loop_timer repeat_timer;
+	int32_t repeat_rate;   // per second, 0 disables repeat
+	int32_t repeat_delay;  // ms
+	uint32_t repeat_keycode;
+	xkb_keysym_t repeat_keysym;
+	bool repeat_inflight;     // a repeat item is with the worker
+	uint64_t repeat_backlog;  // repeats that fired meanwhile
+	bool running;
+	bool wayland_reading;
+	int loop_status;
+
+	struct arena frame_arena;  // renderer strings, reset every panel update
+
 	struct wl_seat *seat;
 	struct zwp_input_method_manager_v2 *input_method_manager;
 	struct zwp_virtual_keyboard_manager_v1 *virtual_keyboard_manager;
 	struct wl_compositor *compositor;
 	struct wl_shm *wl_shm;
+	struct wl_subcompositor *subcompositor;
 
 #ifdef ENABLE_POPUP
 	struct wl_surface *popup_surface;
 	struct zwp_input_popup_surface_v2 *popup_surface_v2;
 	int shm_pool_fd;
 	struct wl_shm_pool *shm_pool;
-	int shm_size;
-	struct wl_buffer *shm_buffer;
+	int shm_size;       // whole pool, POPUP_BUFFERS slots
+	int shm_slot_size;  // one buffer
 	void *popup_data;
+	struct popup_buffer popup_buffers[POPUP_BUFFERS];
+	int popup_front;  // slot on screen, -1 when hidden
+	// pool outgrown while the compositor held some of its buffers, unmapped
+	// once the last of them is released, under render_lock
+	int retired_pool_fd;
+	struct wl_shm_pool *retired_pool;
+	void *retired_data;
+	int retired_size;
+	struct wl_buffer *retired_buffers[POPUP_BUFFERS];
+	int nretired;
+	struct wl_surface *highlight_surface;
+	struct wl_subsurface *highlight_subsurface;
+	int highlight_pool_fd;
+	struct wl_shm_pool *highlight_pool;
+	void *highlight_data;
+	int highlight_pool_size;
+	int highlight_pool_used;
+	struct popup_highlight highlights[POPUP_HIGHLIGHTS];
+	int nhighlights;
+	struct popup_highlight *highlight_shown;
+	int highlight_x, highlight_y;
+	struct loop_timer popup_shrink_timer;
+	bool popup_shown;
+	PangoFontMap *popup_font_map;
 	PangoContext *popup_pango_ctx;
 	PangoLayout *popup_pango_layout;
+	struct cand_cache *cand_cache;
+	struct shaper *shaper;
 	bool frame_callback_done;
 	bool pending_render;
+	struct loop_idle render_idle;
+
+	// rasterization runs on its own thread, one job in flight at a time
+	pthread_t render_thread;
+	bool render_threaded;
+	pthread_mutex_t render_lock;  // popup_front and popup_buffers busy flags
+	pthread_cond_t render_cond;
+	bool render_posted;  // under render_lock, a job waits for the thread
+	bool render_quit;    // under render_lock
+	int render_fd;       // eventfd, the thread finished a frame
+	struct loop_source render_source;
+	bool render_busy;     // main thread, a job is in flight
+	bool render_discard;  // main thread, hidden while the job was in flight
+	struct popup_job render_job;
+	struct popup_frame render_frame;
+	struct arena render_arena;  // render thread scratch strings
 #endif
 
 	struct zwp_input_method_v2 *input_method;
@@ -52,25 +282,100 @@ struct wlpinyin_state {
 
 	bool im_activated;
 	bool im_enabled;
+	enum im_mode im_mode;  // of the focused field, applied on done
+	uint32_t content_hint;  // pending until done
+	uint32_t content_purpose;
+
+	// Events of one wayland dispatch share a panel update, commit and flush
+	struct arena batch_arena;
+	char *batch_commit;  // text committed by the batch keys so far
+	int batch_keys;      // keys waiting for their latency sample
+	uint64_t batch_wakeup_sum;
+	uint64_t batch_wakeup_min;
+	uint64_t batch_event_sum;
+	uint64_t batch_event_min;
+	bool batch_handled;  // the engine took a key, the input method commits
+	bool batch_focus;    // activation changed, the engine resets once
+
+	// Input method state as last sent, requests that change nothing are dropped
+	char *sent_preedit;  // NULL until the first preedit, then reused
+	size_t sent_preedit_cap;
+	int sent_begin;
+	int sent_end;
+	bool sent_pending;  // requests waiting for an input method commit
+	bool preedit_pending;  // the preedit was sent since the last commit
 
 	struct engine *engine;
+	struct key_queue *keys;
+	struct loop_source keys_source;
+	bool panel_deferred;  // the panel waited for the worker to release the engine
 
 	struct xkb_context *xkb_context;
-	char *xkb_keymap_string;
-	struct xkb_keymap *xkb_keymap;
+	struct keymap_entry keymaps[KEYMAP_CACHE_SIZE];
+	struct keymap_entry *keymap;  // current one
+	uint64_t keymap_stamp;
+	uint64_t keymap_uploaded;  // hash of the virtual keyboard's keymap
+	const xkb_keysym_t *keysym_row;  // keysyms under the current modifiers
 	struct xkb_state *xkb_state;
 
 	int rpc_fd;
 	char *rpc_socket_path;
-	int rpc_client;  // single client connection fd
+	struct rpc_client *rpc_clients;  // closed ones stay until reaped when idle
+	int rpc_nclients;
+	struct loop_idle rpc_reap_idle;
+	struct rpc_status rpc_status;
+
+	uint64_t wakeup_us;  // monotonic time the loop last woke up
+	struct wlpinyin_stats stats;
 };
 
 struct wlpinyin_state *im_setup(int signalfd, struct wl_display *display);
 int im_loop(struct wlpinyin_state *state);
 int im_destroy(struct wlpinyin_state *state);
 
+void arena_init(struct arena *, size_t chunk_size);
+void *arena_alloc(struct arena *, size_t size);
+char *arena_strdup(struct arena *, const char *str);
+char *arena_strndup(struct arena *, const char *str, size_t len);
+char *arena_printf(struct arena *, const char *fmt, ...)
+		__attribute__((format(printf, 2, 3)));
+char *arena_append(struct arena *, char *str, const char *fmt, ...)
+		__attribute__((format(printf, 3, 4)));
+void arena_reset(struct arena *);
+void arena_finish(struct arena *);
+void arena_counters(uint64_t *mallocs, uint64_t *frees);
+
+int loop_init(struct wlpinyin_state *);
+void loop_destroy(struct wlpinyin_state *);
+int loop_dispatch(struct wlpinyin_state *);
+int loop_add(struct wlpinyin_state *,
+						 struct loop_source *,
+						 int fd,
+						 uint32_t events,
+						 loop_fd_cb cb,
+						 void *data);
+int loop_modify(struct wlpinyin_state *, struct loop_source *, uint32_t events);
+void loop_remove(struct wlpinyin_state *, struct loop_source *);
+int loop_timer_init(struct wlpinyin_state *,
+										struct loop_timer *,
+										loop_timer_cb cb,
+										void *data);
+void loop_timer_arm(struct loop_timer *, int delay_ms, int interval_ms);
+void loop_timer_finish(struct wlpinyin_state *, struct loop_timer *);
+void loop_idle_init(struct loop_idle *, loop_idle_cb cb, void *data);
+void loop_idle_schedule(struct wlpinyin_state *, struct loop_idle *);
+void loop_idle_cancel(struct wlpinyin_state *, struct loop_idle *);
+
 struct engine *im_engine_new();
 void im_engine_free(struct engine *);
+int im_engine_fd(struct engine *);
+enum im_engine_event im_engine_dispatch(struct engine *);
+bool im_engine_ready(struct engine *);
+int im_engine_redeploy(struct engine *);
+// status of the last deploy, main thread only
+enum im_deploy im_engine_deploy_status(struct engine *);
+// id of the session's schema, safe while the worker owns the engine
+void im_engine_schema(struct engine *, char *buf, size_t size);
 
 typedef struct {
 	char *text;
@@ -78,38 +383,172 @@ typedef struct {
 	int end;
 } im_preedit_t;
 
+// Immutable view of the candidate menu, owned by the engine and valid until
+// the next key, reset or mode change
 typedef struct {
+	uint32_t serial;        // bumped on every state change
 	int page_no;            // 当前页码（行号）
 	int highlighted_index;  // 当前高亮的候选词索引（0-based）
 	int page_size;          // 当前页的候选词数量
-} im_context_t;
+	int first;              // index of texts[0] in the whole candidate list
+	int count;              // number of candidates in texts
+	bool more;              // more candidates follow texts[count - 1]
+	char **texts;
+	char **labels;  // select label of each column, page_size entries
+} im_snapshot_t;
 
-void im_engine_cand_begin(struct engine *engine, int off);
-const char *im_engine_cand_get(struct engine *engine);
-bool im_engine_cand_next(struct engine *engine);
-void im_engine_cand_end(struct engine *engine);
+// Candidates [first, first + count) are fetched from rime only if the
+// snapshot does not cover them yet, count 0 returns the current page
+const im_snapshot_t *im_engine_snapshot(struct engine *, int first, int count);
+// fetch the pages after the current one into the engine's page cache
+void im_engine_prefetch(struct engine *);
 const char *im_engine_commit(struct engine *engine);
 im_preedit_t im_engine_preedit(struct engine *);
-im_context_t im_engine_context(struct engine *);
-bool im_engine_key(struct engine *, xkb_keysym_t, xkb_mod_mask_t);
+// count presses of the same key, the context is read once after them. Returns
+// how many rime took, it stops at the first it rejects.
+int im_engine_key(struct engine *, xkb_keysym_t, xkb_mod_mask_t, int count);
 void im_engine_toggle(struct engine *);
 void im_engine_reset(struct engine *);
 bool im_engine_get_ascii_mode(struct engine *);
 void im_engine_set_ascii_mode(struct engine *, bool ascii_mode);
 
+enum key_job {
+	KEY_JOB_KEY,        // a key press for rime
+	KEY_JOB_TOGGLE,     // the toggle hotkey
+	KEY_JOB_RESET,      // focus changed, drop the composition
+	KEY_JOB_FORWARD,    // a key for the virtual keyboard
+	KEY_JOB_MODIFIERS,  // a modifier update for the virtual keyboard
+};
+
+struct key_item {
+	enum key_job job;
+	uint32_t keycode;
+	xkb_keysym_t keysym;
+	bool pressed;
+	int repeats;  // presses made by key repeat folded into this item, or 0
+	xkb_mod_mask_t mods;  // effective for rime, depressed for modifier updates
+	xkb_mod_mask_t latched;
+	xkb_mod_mask_t locked;
+	xkb_layout_index_t group;
+	bool plain;  // printable without control, alt or logo, see im_key_plain
+	uint64_t wakeup_us;  // loop wakeup that read the event
+	uint64_t event_us;   // compositor timestamp of the event, on our clock
+
+	// filled in by the worker
+	bool handled;
+	int rejected;  // presses rime did not take, all of them if it took none
+	const char *commit;  // owned by the queue, valid until the item is popped
+	uint64_t rime_us;
+	uint64_t done_us;
+};
+
+// Rime runs on a worker thread fed in order through this queue. While items
+// are in flight the engine belongs to the worker, the main thread uses it only
+// once key_queue_idle, or after key_queue_sync.
+struct key_queue *key_queue_new(struct engine *);
+void key_queue_free(struct key_queue *);
+int key_queue_fd(struct key_queue *);  // readable when results are ready
+bool key_queue_push(struct key_queue *, const struct key_item *);
+struct key_item *key_queue_peek(struct key_queue *);  // next result
+void key_queue_pop(struct key_queue *);
+bool key_queue_idle(struct key_queue *);   // the worker has caught up
+bool key_queue_empty(struct key_queue *);  // every result was popped too
+void key_queue_sync(struct key_queue *);
+
+struct keymap_entry *keymap_cache_get(struct wlpinyin_state *,
+																			const char *string,
+																			size_t size,
+																			uint32_t format);
+// row of keysyms for the state's modifiers, NULL if it is not a common one
+const xkb_keysym_t *keymap_cache_row(const struct keymap_entry *,
+																		 struct xkb_state *);
+void keymap_cache_finish(struct wlpinyin_state *);
+
+// input method requests, sent only when they change the client's state
+void im_set_preedit(struct wlpinyin_state *,
+										const char *text,
+										int begin,
+										int end);
+void im_commit_string(struct wlpinyin_state *, const char *text);
+void im_commit(struct wlpinyin_state *);
+
 int im_panel_init(struct wlpinyin_state *);
+int im_panel_warmup(struct wlpinyin_state *);
 int im_panel_update(struct wlpinyin_state *);
 void im_panel_destroy(struct wlpinyin_state *);
 
+#ifdef ENABLE_POPUP
+// LRU of candidate pixel extents and rasterized tiles keyed by the formatted
+// candidate text
+struct cand_cache;
+struct cand_cache *cand_cache_new();
+void cand_cache_free(struct cand_cache *);
+void cand_cache_clear(struct cand_cache *, uint64_t seed);
+bool cand_cache_get(struct cand_cache *, const char *key, PangoRectangle *rect);
+void cand_cache_put(struct cand_cache *,
+										const char *key,
+										const PangoRectangle *rect);
+// clear picks the tile rasterized over a transparent background
+cairo_surface_t *cand_cache_get_tile(struct cand_cache *,
+																		 const char *key,
+																		 bool clear);
+// Takes ownership of tile on success
+bool cand_cache_put_tile(struct cand_cache *,
+												 const char *key,
+												 bool clear,
+												 cairo_surface_t *tile);
+
+// Pool of threads measuring texts in parallel, each with its own Pango context
+struct shaper;
+struct shaper *shaper_new(const PangoFontDescription *desc);
+void shaper_free(struct shaper *);
+void shaper_measure(struct shaper *,
+										PangoLayout *layout,
+										const char *const *texts,
+										PangoRectangle *rects,
+										int n);
+
+// Pixel kernels for premultiplied ARGB8888 buffers
+uint32_t fill_pixel(double r, double g, double b, double a);
+void fill_rect(void *data,
+							 int stride,
+							 int x,
+							 int y,
+							 int width,
+							 int height,
+							 uint32_t pixel);
+void fill_round_corners(void *data,
+												int stride,
+												int width,
+												int height,
+												int radius,
+												int x,
+												int y,
+												int w,
+												int h);
+void fill_blit(void *dst,
+							 int dst_stride,
+							 int dst_width,
+							 int dst_height,
+							 const void *src,
+							 int src_stride,
+							 int src_width,
+							 int src_height,
+							 int dst_x,
+							 int dst_y);
+#endif
+
 int rpc_init(struct wlpinyin_state *);
-void rpc_accept(struct wlpinyin_state *);
-void rpc_handle_client_data(struct wlpinyin_state *);
 void rpc_destroy(struct wlpinyin_state *);
+// push mode, schema and deploy changes to subscribed clients
+void rpc_notify(struct wlpinyin_state *);
 
 #define wlpinyin_err(fmt, ...)                                     \
 	fprintf(stderr, "[%*s:%*d] " fmt "\n", 8, __FILE__, 3, __LINE__, \
 					##__VA_ARGS__)
 
+#define wlpinyin_info(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+
 #ifndef NDEBUG
 #define wlpinyin_dbg(fmt, ...)                                      \
 	fprintf(stderr, " [%*s:%*d] " fmt "\n", 8, __FILE__, 3, __LINE__, \